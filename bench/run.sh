@@ -0,0 +1,176 @@
+#!/bin/sh
+# uhttpd benchmark suite, run from the top of the tree by "make bench"
+#
+# Starts ./uhttpd on a scratch docroot, drives each scenario with
+# bench/uhttpd-bench and writes one JSON object per scenario to
+# $BENCH_OUT. If $BENCH_BASELINE exists the results are compared
+# against it, "make bench-baseline" records a new one.
+#
+#   BENCH_PORT      first of two listen ports, default 8089
+#   BENCH_TIME      seconds per scenario, default 5
+#   BENCH_CONNS     concurrent connections, default 16
+#   BENCH_OUT       default bench/results.json
+#   BENCH_BASELINE  default bench/baseline.json
+#   BENCH_LUA       1 if uhttpd was built with Lua support
+#   BENCH_TLS       1 if uhttpd was built with TLS support
+
+cd "$(dirname "$0")/.." || exit 1
+
+PORT=${BENCH_PORT:-8089}
+TLSPORT=$((PORT + 1))
+TIME=${BENCH_TIME:-5}
+CONNS=${BENCH_CONNS:-16}
+OUT=${BENCH_OUT:-bench/results.json}
+BASELINE=${BENCH_BASELINE:-bench/baseline.json}
+BENCH=bench/uhttpd-bench
+
+[ -x ./uhttpd ] && [ -x $BENCH ] || {
+	echo "Run 'make bench' to build uhttpd and $BENCH first" >&2
+	exit 1
+}
+
+TMP=$(mktemp -d /tmp/uhttpd-bench.XXXXXX) || exit 1
+WWW=$TMP/www
+PID=
+
+cleanup() {
+	[ -n "$PID" ] && kill $PID 2>/dev/null && wait $PID 2>/dev/null
+	rm -rf "$TMP"
+}
+
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+
+# docroot
+mkdir -p $WWW/list $WWW/cgi-bin
+
+head -c 1024 /dev/zero | tr '\0' x > $WWW/small.txt
+dd if=/dev/zero of=$WWW/large.bin bs=1 count=0 seek=100M 2>/dev/null
+
+i=0
+while [ $i -lt 200 ]; do
+	echo $i > $WWW/list/file-$i.txt
+	i=$((i + 1))
+done
+
+cat > $WWW/cgi-bin/hello.sh <<EOF
+#!/bin/sh
+printf 'Content-Type: text/plain\r\n\r\nHello, world\n'
+EOF
+chmod 755 $WWW/cgi-bin/hello.sh
+
+
+# optional plugins
+set -- -f -h $WWW -c /cgi-bin -p 127.0.0.1:$PORT -n $((CONNS * 2))
+
+LUA=
+if [ "$BENCH_LUA" = 1 ] && [ -f ./uhttpd_lua.so ]; then
+	cat > $TMP/hello.lua <<EOF
+function handle_request(env)
+	uhttpd.send("HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n")
+	uhttpd.send("Hello, world\n")
+end
+EOF
+	set -- "$@" -l /lua -L $TMP/hello.lua
+	LUA=1
+fi
+
+TLS=
+if [ "$BENCH_TLS" = 1 ] && [ -f ./uhttpd_tls.so ] && openssl req -x509 -newkey rsa:2048 -nodes \
+	-keyout $TMP/key.pem -out $TMP/cert.pem -days 1 -subj /CN=localhost \
+	>/dev/null 2>&1; then
+	set -- "$@" -C $TMP/cert.pem -K $TMP/key.pem -s 127.0.0.1:$TLSPORT
+	TLS=1
+fi
+
+LD_LIBRARY_PATH=.${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH} ./uhttpd "$@" &
+PID=$!
+
+i=0
+until $BENCH -c 1 -n 1 http://127.0.0.1:$PORT/small.txt >/dev/null 2>&1; do
+	i=$((i + 1))
+	if [ $i -ge 50 ] || ! kill -0 $PID 2>/dev/null; then
+		echo "uhttpd did not come up on port $PORT" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+if [ -n "$TLS" ] && ! $BENCH -c 1 -n 1 https://127.0.0.1:$TLSPORT/small.txt \
+	>/dev/null 2>&1; then
+	echo "Skipping tls, $BENCH was built without TLS or the handshake failed" >&2
+	TLS=
+fi
+
+
+# scenarios
+RESULTS=$TMP/results
+
+run() {
+	name=$1; shift
+	$BENCH -N $name -p $PID -d $TIME "$@" >> $RESULTS
+}
+
+: > $RESULTS
+
+run small      -c $CONNS http://127.0.0.1:$PORT/small.txt
+run large      -c 4      http://127.0.0.1:$PORT/large.bin
+run listing    -c $CONNS http://127.0.0.1:$PORT/list/
+run cgi        -c $CONNS http://127.0.0.1:$PORT/cgi-bin/hello.sh
+[ -n "$LUA" ] && \
+run lua        -c $CONNS http://127.0.0.1:$PORT/lua/hello
+run revalidate -c $CONNS -s 304 \
+	-H "If-Modified-Since: Fri, 01 Jan 2100 00:00:00 GMT" \
+	http://127.0.0.1:$PORT/small.txt
+[ -n "$TLS" ] && \
+run tls        -c $CONNS https://127.0.0.1:$TLSPORT/small.txt
+
+{
+	printf '{"commit":"%s","date":"%s","time":%d,"connections":%d,"scenarios":[\n' \
+		"$(git rev-parse --short HEAD 2>/dev/null)" \
+		"$(date -u +%Y-%m-%dT%H:%M:%SZ)" $TIME $CONNS
+	sed '$!s/$/,/' $RESULTS
+	printf ']}\n'
+} > $OUT
+
+echo "Results written to $OUT" >&2
+
+
+# comparison, both files carry one scenario per line
+[ -f "$BASELINE" ] && [ "$BASELINE" != "$OUT" ] || exit 0
+
+echo "Compared to $BASELINE:" >&2
+
+awk '
+	function get(line, key) {
+		if (!match(line, "\"" key "\":[^,}]*"))
+			return ""
+		line = substr(line, RSTART + length(key) + 3, RLENGTH - length(key) - 3)
+		gsub(/"/, "", line)
+		return line
+	}
+
+	function delta(a, b) {
+		return (b > 0) ? sprintf("%+6.1f%%", (a - b) * 100 / b) : "     -"
+	}
+
+	/"scenario":/ {
+		name = get($0, "scenario")
+
+		if (FILENAME == ARGV[1]) {
+			rps[name] = get($0, "rps")
+			p99[name] = get($0, "p99_us")
+			next
+		}
+
+		if (!(name in rps)) {
+			printf "%-12s    new\n", name
+			next
+		}
+
+		printf "%-12s  req/s %s  p99 %s\n", name,
+			delta(get($0, "rps"), rps[name]),
+			delta(get($0, "p99_us"), p99[name])
+	}
+' "$BASELINE" "$OUT" >&2
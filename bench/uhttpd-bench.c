@@ -0,0 +1,652 @@
+/*
+ * uhttpd - Tiny single-threaded httpd - Load generator
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#define _GNU_SOURCE		/* SOCK_NONBLOCK */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "libubox/uloop.h"
+
+#ifdef HAVE_TLS
+#include <openssl/ssl.h>
+#endif
+
+#define BENCH_BUF		(64 * 1024)
+#define BENCH_HEADERS	16
+
+#define BENCH_CONNECT	0
+#define BENCH_HANDSHAKE	1
+#define BENCH_SEND		2
+#define BENCH_RECV		3
+
+/* one request per connection, as uhttpd closes after every response */
+struct bench_conn {
+	struct uloop_fd fd;
+#ifdef HAVE_TLS
+	SSL *tls;
+#endif
+	int state;
+	int sent;
+	int status;
+	char line[16];
+	int linelen;
+	unsigned long long start;
+};
+
+static struct addrinfo *bench_addr;
+static char bench_request[4096];
+static int bench_reqlen;
+static bool bench_tls;
+
+static int bench_expect = 200;
+static long bench_limit;
+static bool bench_stopping;
+static int bench_active;
+
+static long bench_issued, bench_done, bench_errors;
+static unsigned long long bench_bytes;
+
+static unsigned int *bench_lat;
+static long bench_nlat, bench_szlat;
+
+static char bench_buf[BENCH_BUF];
+
+#ifdef HAVE_TLS
+static SSL_CTX *bench_ctx;
+#endif
+
+static void bench_start(struct bench_conn *c);
+
+
+static unsigned long long bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void bench_record(unsigned long long us)
+{
+	unsigned int *tmp;
+
+	if (bench_nlat == bench_szlat)
+	{
+		bench_szlat = bench_szlat ? bench_szlat * 2 : 4096;
+
+		if (!(tmp = realloc(bench_lat, bench_szlat * sizeof(*tmp))))
+		{
+			bench_szlat = bench_nlat;
+			return;
+		}
+
+		bench_lat = tmp;
+	}
+
+	bench_lat[bench_nlat++] = (us > 0xFFFFFFFFULL) ? 0xFFFFFFFFU : us;
+}
+
+static void bench_finish(struct bench_conn *c, bool ok)
+{
+	if (ok && (c->status == bench_expect))
+	{
+		bench_done++;
+		bench_record(bench_now() - c->start);
+	}
+	else
+	{
+		bench_errors++;
+	}
+
+	uloop_fd_delete(&c->fd);
+
+#ifdef HAVE_TLS
+	if (c->tls)
+	{
+		SSL_free(c->tls);
+		c->tls = NULL;
+	}
+#endif
+
+	close(c->fd.fd);
+	bench_start(c);
+}
+
+/* status code off the first bytes of the response */
+static void bench_status(struct bench_conn *c, const char *buf, int len)
+{
+	int room = sizeof(c->line) - 1 - c->linelen;
+
+	if (len > room)
+		len = room;
+
+	memcpy(c->line + c->linelen, buf, len);
+	c->linelen += len;
+	c->line[c->linelen] = 0;
+
+	if ((c->linelen >= 12) && !strncmp(c->line, "HTTP/", 5))
+		c->status = atoi(c->line + 9);
+}
+
+static int bench_io(struct bench_conn *c, bool write, char *buf, int len)
+{
+#ifdef HAVE_TLS
+	int rv;
+
+	if (c->tls)
+	{
+		rv = write ? SSL_write(c->tls, buf, len) : SSL_read(c->tls, buf, len);
+
+		if (rv > 0)
+			return rv;
+
+		switch (SSL_get_error(c->tls, rv))
+		{
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				errno = EAGAIN;
+				return -1;
+
+			case SSL_ERROR_ZERO_RETURN:
+				return 0;
+
+			case SSL_ERROR_SYSCALL:
+				/* peer closed without close_notify */
+				if (!rv || !errno)
+					return 0;
+
+				/* fall through */
+
+			default:
+				errno = EIO;
+				return -1;
+		}
+	}
+#endif
+
+	return write ? send(c->fd.fd, buf, len, MSG_NOSIGNAL)
+		: recv(c->fd.fd, buf, len, 0);
+}
+
+static void bench_cb(struct uloop_fd *u, unsigned int events)
+{
+	int rv, err;
+	socklen_t sl = sizeof(err);
+	struct bench_conn *c = container_of(u, struct bench_conn, fd);
+
+	switch (c->state)
+	{
+	case BENCH_CONNECT:
+		if (getsockopt(u->fd, SOL_SOCKET, SO_ERROR, &err, &sl) || err)
+		{
+			bench_finish(c, false);
+			return;
+		}
+
+		c->state = BENCH_SEND;
+
+#ifdef HAVE_TLS
+		if (bench_tls)
+		{
+			if (!(c->tls = SSL_new(bench_ctx)) || !SSL_set_fd(c->tls, u->fd))
+			{
+				bench_finish(c, false);
+				return;
+			}
+
+			c->state = BENCH_HANDSHAKE;
+		}
+#endif
+
+		/* fall through */
+
+#ifdef HAVE_TLS
+	case BENCH_HANDSHAKE:
+		if (c->state == BENCH_HANDSHAKE)
+		{
+			if ((rv = SSL_connect(c->tls)) < 1)
+			{
+				switch (SSL_get_error(c->tls, rv))
+				{
+					case SSL_ERROR_WANT_READ:
+						uloop_fd_add(u, ULOOP_READ);
+						return;
+
+					case SSL_ERROR_WANT_WRITE:
+						uloop_fd_add(u, ULOOP_WRITE);
+						return;
+
+					default:
+						bench_finish(c, false);
+						return;
+				}
+			}
+
+			c->state = BENCH_SEND;
+		}
+
+		/* fall through */
+#endif
+
+	case BENCH_SEND:
+		while (c->sent < bench_reqlen)
+		{
+			rv = bench_io(c, true, bench_request + c->sent,
+						  bench_reqlen - c->sent);
+
+			if (rv > 0)
+			{
+				c->sent += rv;
+				continue;
+			}
+
+			if ((rv < 0) && (errno == EAGAIN))
+			{
+				uloop_fd_add(u, ULOOP_WRITE);
+				return;
+			}
+
+			bench_finish(c, false);
+			return;
+		}
+
+		c->state = BENCH_RECV;
+		uloop_fd_add(u, ULOOP_READ);
+
+		/* fall through */
+
+	case BENCH_RECV:
+		while (true)
+		{
+			rv = bench_io(c, false, bench_buf, sizeof(bench_buf));
+
+			if (rv > 0)
+			{
+				if (c->linelen < sizeof(c->line) - 1)
+					bench_status(c, bench_buf, rv);
+
+				bench_bytes += rv;
+				continue;
+			}
+
+			if (rv == 0)
+			{
+				bench_finish(c, true);
+				return;
+			}
+
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN)
+				bench_finish(c, false);
+
+			return;
+		}
+	}
+}
+
+static void bench_start(struct bench_conn *c)
+{
+	int fd;
+
+	while (!bench_stopping && (!bench_limit || (bench_issued < bench_limit)))
+	{
+		bench_issued++;
+
+		memset(c, 0, sizeof(*c));
+		c->start = bench_now();
+
+		fd = socket(bench_addr->ai_family,
+					SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+		if (fd < 0)
+		{
+			perror("socket()");
+			bench_stopping = true;
+			break;
+		}
+
+		if (connect(fd, bench_addr->ai_addr, bench_addr->ai_addrlen) &&
+			(errno != EINPROGRESS))
+		{
+			close(fd);
+			bench_errors++;
+			continue;
+		}
+
+		c->fd.fd = fd;
+		c->fd.cb = bench_cb;
+		c->state = BENCH_CONNECT;
+
+		uloop_fd_add(&c->fd, ULOOP_WRITE);
+		return;
+	}
+
+	free(c);
+
+	if (--bench_active == 0)
+		uloop_end();
+}
+
+static void bench_deadline_cb(struct uloop_timeout *t)
+{
+	bench_stopping = true;
+}
+
+
+/* utime + stime of the server and its reaped children, in ticks */
+static unsigned long long bench_cpu(pid_t pid)
+{
+	FILE *f;
+	char path[64], buf[1024], *p;
+	unsigned long long ut, st, cut, cst;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+	if (!(f = fopen(path, "r")))
+		return 0;
+
+	p = fgets(buf, sizeof(buf), f);
+	fclose(f);
+
+	if (!p || !(p = strrchr(buf, ')')) ||
+		(sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+				"%llu %llu %llu %llu", &ut, &st, &cut, &cst) != 4))
+		return 0;
+
+	return ut + st + cut + cst;
+}
+
+static unsigned long bench_rss(pid_t pid, const char *key)
+{
+	FILE *f;
+	char path[64], buf[256];
+	unsigned long kb = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+
+	if (!(f = fopen(path, "r")))
+		return 0;
+
+	while (fgets(buf, sizeof(buf), f))
+		if (!strncmp(buf, key, strlen(key)) &&
+			(sscanf(buf + strlen(key), " %lu", &kb) == 1))
+			break;
+
+	fclose(f);
+
+	return kb;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+
+	return (x > y) - (x < y);
+}
+
+static unsigned int bench_percentile(int permille)
+{
+	long idx;
+
+	if (!bench_nlat)
+		return 0;
+
+	idx = (bench_nlat * permille + 999) / 1000 - 1;
+
+	return bench_lat[(idx < 0) ? 0 : idx];
+}
+
+/* [http|https]://host[:port]/path */
+static bool bench_target(const char *url, char *host, int hlen,
+						 char *port, int plen, const char **path)
+{
+	const char *p, *e;
+
+	if (!strncmp(url, "https://", 8))
+	{
+		bench_tls = true;
+		url += 8;
+	}
+	else if (!strncmp(url, "http://", 7))
+	{
+		url += 7;
+	}
+
+	if ((e = strchr(url, '/')) != NULL)
+	{
+		*path = e;
+	}
+	else
+	{
+		*path = "/";
+		e = url + strlen(url);
+	}
+
+	if (!(p = memchr(url, ':', e - url)))
+		p = e;
+
+	if ((p - url) >= hlen)
+		return false;
+
+	memcpy(host, url, p - url);
+	host[p - url] = 0;
+
+	if (p < e)
+		snprintf(port, plen, "%.*s", (int)(e - p - 1), p + 1);
+	else
+		snprintf(port, plen, "%s", bench_tls ? "443" : "80");
+
+	return host[0];
+}
+
+static void bench_usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] http[s]://host[:port]/path\n"
+		"	-c count        Concurrent connections, default is 8\n"
+		"	-n count        Stop after count requests\n"
+		"	-d seconds      Stop after seconds, default is 5 unless -n is given\n"
+		"	-H header       Add a request header, may be repeated\n"
+		"	-s code         Expected status code, default is 200\n"
+		"	-p pid          Report CPU time and memory of this server process\n"
+		"	-N name         Scenario name for the JSON result\n"
+		"\n", name);
+
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int i, opt, conns = 8, nhdr = 0;
+	int duration = 0;
+	pid_t pid = 0;
+	char host[256], port[16];
+	const char *path, *name = "bench";
+	const char *headers[BENCH_HEADERS];
+	unsigned long long started, elapsed, cpu = 0;
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+	struct uloop_timeout deadline = { .cb = bench_deadline_cb };
+	struct bench_conn *c;
+
+	while ((opt = getopt(argc, argv, "c:n:d:H:s:p:N:")) > 0)
+	{
+		switch (opt)
+		{
+			case 'c':
+				conns = atoi(optarg);
+				break;
+
+			case 'n':
+				bench_limit = atol(optarg);
+				break;
+
+			case 'd':
+				duration = atoi(optarg);
+				break;
+
+			case 'H':
+				if (nhdr < BENCH_HEADERS)
+					headers[nhdr++] = optarg;
+				break;
+
+			case 's':
+				bench_expect = atoi(optarg);
+				break;
+
+			case 'p':
+				pid = atoi(optarg);
+				break;
+
+			case 'N':
+				name = optarg;
+				break;
+
+			default:
+				bench_usage(argv[0]);
+		}
+	}
+
+	if ((optind >= argc) || (conns < 1) ||
+		!bench_target(argv[optind], host, sizeof(host), port, sizeof(port),
+					  &path))
+		bench_usage(argv[0]);
+
+	if (!bench_limit && (duration <= 0))
+		duration = 5;
+
+	if ((i = getaddrinfo(host, port, &hints, &bench_addr)) != 0)
+	{
+		fprintf(stderr, "Error: Unable to resolve %s: %s\n",
+				host, gai_strerror(i));
+		return 1;
+	}
+
+	bench_reqlen = snprintf(bench_request, sizeof(bench_request),
+		"GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n"
+		"User-Agent: uhttpd-bench\r\n", path, host);
+
+	for (i = 0; i < nhdr; i++)
+		bench_reqlen += snprintf(bench_request + bench_reqlen,
+								 sizeof(bench_request) - bench_reqlen,
+								 "%s\r\n", headers[i]);
+
+	bench_reqlen += snprintf(bench_request + bench_reqlen,
+							 sizeof(bench_request) - bench_reqlen, "\r\n");
+
+	if (bench_reqlen >= sizeof(bench_request))
+	{
+		fprintf(stderr, "Error: Request headers too long\n");
+		return 1;
+	}
+
+	if (bench_tls)
+	{
+#ifdef HAVE_TLS
+		SSL_library_init();
+
+		/* fresh handshakes only, sessions are never reused */
+		if (!(bench_ctx = SSL_CTX_new(SSLv23_client_method())))
+		{
+			fprintf(stderr, "Error: Unable to create TLS context\n");
+			return 1;
+		}
+
+		SSL_CTX_set_session_cache_mode(bench_ctx, SSL_SESS_CACHE_OFF);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+		SSL_CTX_set_options(bench_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#else
+		fprintf(stderr, "Error: Built without TLS support\n");
+		return 1;
+#endif
+	}
+
+	uloop_init();
+
+	if (pid)
+		cpu = bench_cpu(pid);
+
+	started = bench_now();
+
+	if (duration > 0)
+		uloop_timeout_set(&deadline, duration * 1000);
+
+	for (i = 0; i < conns; i++)
+	{
+		if (!(c = calloc(1, sizeof(*c))))
+			break;
+
+		bench_active++;
+		bench_start(c);
+	}
+
+	if (bench_active)
+		uloop_run();
+
+	elapsed = bench_now() - started;
+
+	if (pid)
+		cpu = bench_cpu(pid) - cpu;
+
+	uloop_done();
+
+	qsort(bench_lat, bench_nlat, sizeof(*bench_lat), bench_cmp);
+
+	fprintf(stderr,
+			"%-12s %8ld ok %6ld err %10.1f req/s  p50 %7uus  p99 %7uus  "
+			"%8.1f MB/s",
+			name, bench_done, bench_errors,
+			bench_done * 1e6 / elapsed,
+			bench_percentile(500), bench_percentile(990),
+			bench_bytes / (double)elapsed);
+
+	if (pid)
+		fprintf(stderr, "  cpu %5.1f%%  rss %lukB",
+				cpu * 1e8 / sysconf(_SC_CLK_TCK) / elapsed,
+				bench_rss(pid, "VmRSS:"));
+
+	fprintf(stderr, "\n");
+
+	printf("{\"scenario\":\"%s\",\"requests\":%ld,\"errors\":%ld,"
+		   "\"rps\":%.1f,\"p50_us\":%u,\"p99_us\":%u,\"mb_per_s\":%.1f",
+		   name, bench_done, bench_errors, bench_done * 1e6 / elapsed,
+		   bench_percentile(500), bench_percentile(990),
+		   bench_bytes / (double)elapsed);
+
+	if (pid)
+		printf(",\"cpu_pct\":%.1f,\"rss_kb\":%lu,\"rss_peak_kb\":%lu",
+			   cpu * 1e8 / sysconf(_SC_CLK_TCK) / elapsed,
+			   bench_rss(pid, "VmRSS:"), bench_rss(pid, "VmHWM:"));
+
+	printf("}\n");
+
+	freeaddrinfo(bench_addr);
+	free(bench_lat);
+
+	return (bench_done && !bench_errors) ? 0 : 1;
+}
@@ -0,0 +1,136 @@
+/*
+ * uloop-timeout-bench.c
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "uloop.h"
+
+struct bench_timeout {
+	struct uloop_timeout t;
+	int id;
+};
+
+static struct bench_timeout *timers;
+static int n_timers = 100000;
+static int fired, errors, last_id = -1;
+static struct timeval last;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, int ops, double start)
+{
+	double t = now() - start;
+
+	printf("%-24s %8d ops %10.3f ms %8.1f ns/op\n",
+	       what, ops, t * 1e3, t * 1e9 / ops);
+}
+
+static void fire_cb(struct uloop_timeout *t)
+{
+	struct bench_timeout *b = container_of(t, struct bench_timeout, t);
+
+	/* expiry must never go backwards, equal ones fire in arming order */
+	if (t->time.tv_sec < last.tv_sec ||
+	    (t->time.tv_sec == last.tv_sec && t->time.tv_usec < last.tv_usec))
+		errors++;
+
+	if (t->time.tv_sec == last.tv_sec &&
+	    t->time.tv_usec == last.tv_usec && b->id < last_id)
+		errors++;
+
+	last = t->time;
+	last_id = b->id;
+
+	if (++fired == (n_timers + 1) / 2)
+		uloop_end();
+}
+
+int main(int argc, char **argv)
+{
+	double start;
+	int i, n;
+
+	if (argc > 1)
+		n_timers = atoi(argv[1]);
+
+	if (n_timers < 2)
+		n_timers = 2;
+
+	timers = calloc(n_timers, sizeof(*timers));
+	if (!timers)
+		return 1;
+
+	srandom(1);
+	uloop_init();
+
+	start = now();
+	for (i = 0; i < n_timers; i++) {
+		timers[i].t.cb = fire_cb;
+		uloop_timeout_set(&timers[i].t, 1000 + random() % 60000);
+	}
+	report("add", n_timers, start);
+
+	/* re-arming a pending timeout, as done for every client read */
+	start = now();
+	for (i = 0; i < n_timers; i++)
+		uloop_timeout_set(&timers[random() % n_timers].t,
+				  1000 + random() % 60000);
+	report("re-arm", n_timers, start);
+
+	start = now();
+	for (i = 0; i < n_timers; i++)
+		uloop_timeout_cancel(&timers[i].t);
+	report("cancel", n_timers, start);
+
+	/* half of them expire in a handful of distinct slots, half are
+	 * cancelled from the middle of the heap before they get to run */
+	for (i = 0; i < n_timers; i++) {
+		timers[i].id = i;
+		uloop_timeout_set(&timers[i].t, (i % 2) ? 5000 : (i / 2) % 8);
+	}
+
+	for (i = 1; i < n_timers; i += 2)
+		uloop_timeout_cancel(&timers[i].t);
+
+	start = now();
+	uloop_run();
+	report("expire", fired, start);
+
+	n = 0;
+	for (i = 0; i < n_timers; i++)
+		n += timers[i].t.pending;
+
+	if (n)
+		errors++;
+
+	uloop_done();
+	free(timers);
+
+	if (errors) {
+		fprintf(stderr, "%d ordering errors\n", errors);
+		return 1;
+	}
+
+	return 0;
+}
@@ -58,7 +58,7 @@ static int register_poll(struct uloop_fd *fd, unsigned int flags)
 	return epoll_ctl(poll_fd, op, fd->fd, &ev);
 }
 
-static struct epoll_event events[ULOOP_MAX_EVENTS];
+static struct epoll_event *events;
 
 static int __uloop_fd_delete(struct uloop_fd *sock)
 {
@@ -70,7 +70,7 @@ static int uloop_fetch_events(int timeout)
 {
 	int n, nfds;
 
-	nfds = epoll_wait(poll_fd, events, ARRAY_SIZE(events), timeout);
+	nfds = epoll_wait(poll_fd, events, cur_size, timeout);
 	for (n = 0; n < nfds; ++n) {
 		struct uloop_fd_event *cur = &cur_fds[n];
 		struct uloop_fd *u = events[n].data.ptr;
@@ -48,7 +48,7 @@ static uint16_t get_flags(unsigned int flags, unsigned int mask)
 	return kflags;
 }
 
-static struct kevent events[ULOOP_MAX_EVENTS];
+static struct kevent *events;
 
 static int register_kevent(struct uloop_fd *fd, unsigned int flags)
 {
@@ -111,7 +111,7 @@ static int uloop_fetch_events(int timeout)
 		ts.tv_nsec = (timeout % 1000) * 1000000;
 	}
 
-	nfds = kevent(poll_fd, NULL, 0, events, ARRAY_SIZE(events), timeout >= 0 ? &ts : NULL);
+	nfds = kevent(poll_fd, NULL, 0, events, cur_size, timeout >= 0 ? &ts : NULL);
 	for (n = 0; n < nfds; n++) {
 		struct uloop_fd_event *cur = &cur_fds[n];
 		struct uloop_fd *u = events[n].udata;
@@ -51,9 +51,16 @@ struct uloop_fd_stack {
 
 static struct uloop_fd_stack *fd_stack = NULL;
 
-#define ULOOP_MAX_EVENTS 10
+/* the event batch starts small and doubles each time a fetch fills it */
+#define ULOOP_MIN_EVENTS 16
+#ifndef ULOOP_MAX_EVENTS
+#define ULOOP_MAX_EVENTS 1024
+#endif
 
-static struct list_head timeouts = LIST_HEAD_INIT(timeouts);
+/* pending timeouts, 4-ary min-heap ordered by expiry, then insertion */
+static struct uloop_timeout **timeouts;
+static int timeout_count, timeout_size;
+static unsigned int timeout_seq;
 static struct list_head processes = LIST_HEAD_INIT(processes);
 
 static int poll_fd = -1;
@@ -62,8 +69,8 @@ bool uloop_handle_sigchld = true;
 static int uloop_status = 0;
 static bool do_sigchld = false;
 
-static struct uloop_fd_event cur_fds[ULOOP_MAX_EVENTS];
-static int cur_fd, cur_nfds;
+static struct uloop_fd_event *cur_fds;
+static int cur_fd, cur_nfds, cur_size;
 static int uloop_run_depth = 0;
 
 int uloop_fd_add(struct uloop_fd *sock, unsigned int flags);
@@ -76,6 +83,32 @@ int uloop_fd_add(struct uloop_fd *sock, unsigned int flags);
 #include "uloop-epoll.c"
 #endif
 
+static int uloop_grow_events(void)
+{
+	struct uloop_fd_event *tmp;
+	void *ev;
+	int size = cur_size ? cur_size * 2 : ULOOP_MIN_EVENTS;
+
+	if (size > ULOOP_MAX_EVENTS)
+		return -1;
+
+	/* pending entries of the current batch are kept */
+	tmp = realloc(cur_fds, size * sizeof(*cur_fds));
+	if (!tmp)
+		return -1;
+
+	cur_fds = tmp;
+
+	ev = realloc(events, size * sizeof(*events));
+	if (!ev)
+		return -1;
+
+	events = ev;
+	cur_size = size;
+
+	return 0;
+}
+
 static void waker_consume(struct uloop_fd *fd, unsigned int events)
 {
 	char buf[4];
@@ -124,6 +157,11 @@ int uloop_init(void)
 	if (uloop_init_pollfd() < 0)
 		return -1;
 
+	if (!cur_size && uloop_grow_events() < 0) {
+		uloop_done();
+		return -1;
+	}
+
 	if (waker_init() < 0) {
 		uloop_done();
 		return -1;
@@ -170,6 +208,9 @@ static void uloop_run_events(int timeout)
 		cur_nfds = uloop_fetch_events(timeout);
 		if (cur_nfds < 0)
 			cur_nfds = 0;
+
+		if (cur_nfds == cur_size)
+			uloop_grow_events();
 	}
 
 	while (cur_nfds > 0) {
@@ -256,23 +297,85 @@ static int tv_diff(struct timeval *t1, struct timeval *t2)
 		(t1->tv_usec - t2->tv_usec) / 1000;
 }
 
+static bool timeout_before(struct uloop_timeout *a, struct uloop_timeout *b)
+{
+	if (a->time.tv_sec != b->time.tv_sec)
+		return a->time.tv_sec < b->time.tv_sec;
+
+	if (a->time.tv_usec != b->time.tv_usec)
+		return a->time.tv_usec < b->time.tv_usec;
+
+	/* same expiry: keep the order they were added in */
+	return (int)(a->seq - b->seq) < 0;
+}
+
+static void timeout_place(struct uloop_timeout *t, int idx)
+{
+	timeouts[idx] = t;
+	t->index = idx;
+}
+
+static void timeout_sift_up(struct uloop_timeout *t, int idx)
+{
+	int parent;
+
+	while (idx > 0) {
+		parent = (idx - 1) / 4;
+		if (!timeout_before(t, timeouts[parent]))
+			break;
+
+		timeout_place(timeouts[parent], idx);
+		idx = parent;
+	}
+
+	timeout_place(t, idx);
+}
+
+static void timeout_sift_down(struct uloop_timeout *t, int idx)
+{
+	int i, child, min;
+
+	while (1) {
+		child = idx * 4 + 1;
+		if (child >= timeout_count)
+			break;
+
+		min = child;
+		for (i = child + 1; i < child + 4 && i < timeout_count; i++)
+			if (timeout_before(timeouts[i], timeouts[min]))
+				min = i;
+
+		if (!timeout_before(timeouts[min], t))
+			break;
+
+		timeout_place(timeouts[min], idx);
+		idx = min;
+	}
+
+	timeout_place(t, idx);
+}
+
 int uloop_timeout_add(struct uloop_timeout *timeout)
 {
-	struct uloop_timeout *tmp;
-	struct list_head *h = &timeouts;
+	struct uloop_timeout **tmp;
+	int size;
 
 	if (timeout->pending)
 		return -1;
 
-	list_for_each_entry(tmp, &timeouts, list) {
-		if (tv_diff(&tmp->time, &timeout->time) > 0) {
-			h = &tmp->list;
-			break;
-		}
+	if (timeout_count == timeout_size) {
+		size = timeout_size ? timeout_size * 2 : 64;
+		tmp = realloc(timeouts, size * sizeof(*timeouts));
+		if (!tmp)
+			return -1;
+
+		timeouts = tmp;
+		timeout_size = size;
 	}
 
-	list_add_tail(&timeout->list, h);
+	timeout->seq = timeout_seq++;
 	timeout->pending = true;
+	timeout_sift_up(timeout, timeout_count++);
 
 	return 0;
 }
@@ -308,12 +411,24 @@ int uloop_timeout_set(struct uloop_timeout *timeout, int msecs)
 
 int uloop_timeout_cancel(struct uloop_timeout *timeout)
 {
+	struct uloop_timeout *last;
+	int idx = timeout->index;
+
 	if (!timeout->pending)
 		return -1;
 
-	list_del(&timeout->list);
 	timeout->pending = false;
 
+	last = timeouts[--timeout_count];
+	if (last == timeout)
+		return 0;
+
+	/* fill the hole with the last entry and restore the heap order */
+	if (idx > 0 && timeout_before(last, timeouts[(idx - 1) / 4]))
+		timeout_sift_up(last, idx);
+	else
+		timeout_sift_down(last, idx);
+
 	return 0;
 }
 
@@ -479,10 +594,10 @@ static int uloop_get_next_timeout(struct timeval *tv)
 	struct uloop_timeout *timeout;
 	int diff;
 
-	if (list_empty(&timeouts))
+	if (!timeout_count)
 		return -1;
 
-	timeout = list_first_entry(&timeouts, struct uloop_timeout, list);
+	timeout = timeouts[0];
 	diff = tv_diff(&timeout->time, tv);
 	if (diff < 0)
 		return 0;
@@ -494,8 +609,8 @@ static void uloop_process_timeouts(struct timeval *tv)
 {
 	struct uloop_timeout *t;
 
-	while (!list_empty(&timeouts)) {
-		t = list_first_entry(&timeouts, struct uloop_timeout, list);
+	while (timeout_count) {
+		t = timeouts[0];
 
 		if (tv_diff(&t->time, tv) > 0)
 			break;
@@ -508,10 +623,12 @@ static void uloop_process_timeouts(struct timeval *tv)
 
 static void uloop_clear_timeouts(void)
 {
-	struct uloop_timeout *t, *tmp;
+	while (timeout_count)
+		uloop_timeout_cancel(timeouts[timeout_count - 1]);
 
-	list_for_each_entry_safe(t, tmp, &timeouts, list)
-		uloop_timeout_cancel(t);
+	free(timeouts);
+	timeouts = NULL;
+	timeout_size = 0;
 }
 
 static void uloop_clear_processes(void)
@@ -578,4 +695,10 @@ void uloop_done(void)
 
 	uloop_clear_timeouts();
 	uloop_clear_processes();
+
+	free(cur_fds);
+	free(events);
+	cur_fds = NULL;
+	events = NULL;
+	cur_nfds = cur_size = 0;
 }
@@ -67,7 +67,8 @@ struct uloop_fd
 
 struct uloop_timeout
 {
-	struct list_head list;
+	int index;
+	unsigned int seq;
 	bool pending;
 
 	uloop_timeout_handler cb;
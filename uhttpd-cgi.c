@@ -180,7 +180,7 @@ static bool uh_cgi_socket_cb(struct client *cl)
 
 		/* ... write to CGI process */
 		len = uh_raw_send(state->wfd, buf, len,
-						  cl->server->conf->script_timeout);
+						  cl->conf->script_timeout);
 
 		/* explicit EOF notification for the child */
 		if (state->content_length <= 0)
@@ -293,6 +293,9 @@ static bool uh_cgi_socket_cb(struct client *cl)
 		goto out;
 	}
 
+	/* child is idle, do not hold back buffered output */
+	ensure_out(uh_tcp_flush(state->cl));
+
 	return true;
 
 out:
@@ -396,9 +399,9 @@ bool uh_cgi_request(struct client *cl, struct path_info *pi,
 #endif
 
 			/* addresses */
-			setenv("SERVER_NAME", sa_straddr(&cl->servaddr), 1);
-			setenv("SERVER_ADDR", sa_straddr(&cl->servaddr), 1);
-			setenv("SERVER_PORT", sa_strport(&cl->servaddr), 1);
+			setenv("SERVER_NAME", sa_straddr(uh_client_servaddr(cl)), 1);
+			setenv("SERVER_ADDR", sa_straddr(uh_client_servaddr(cl)), 1);
+			setenv("SERVER_PORT", sa_strport(uh_client_servaddr(cl)), 1);
 			setenv("REMOTE_HOST", sa_straddr(&cl->peeraddr), 1);
 			setenv("REMOTE_ADDR", sa_straddr(&cl->peeraddr), 1);
 			setenv("REMOTE_PORT", sa_strport(&cl->peeraddr), 1);
@@ -349,10 +349,8 @@ out:
 
 bool uh_file_request(struct client *cl, struct path_info *pi)
 {
-	int rlen;
 	int ok = 1;
 	int fd = -1;
-	char buf[UH_LIMIT_MSGHEAD];
 
 	/* we have a file */
 	if ((pi->stat.st_mode & S_IFREG) && ((fd = open(pi->phys, O_RDONLY)) > 0))
@@ -372,8 +370,8 @@ bool uh_file_request(struct client *cl, struct path_info *pi)
 			ensure_out(uh_http_sendf(cl, NULL, "Content-Type: %s\r\n",
 									 uh_file_mime_lookup(pi->name)));
 
-			ensure_out(uh_http_sendf(cl, NULL, "Content-Length: %i\r\n",
-									 pi->stat.st_size));
+			ensure_out(uh_http_sendf(cl, NULL, "Content-Length: %llu\r\n",
+									 (unsigned long long)pi->stat.st_size));
 
 			/* if request was HTTP 1.1 we'll respond chunked */
 			if ((cl->request.version > 1.0) &&
@@ -389,9 +387,15 @@ bool uh_file_request(struct client *cl, struct path_info *pi)
 			/* send body */
 			if (cl->request.method != UH_HTTP_MSG_HEAD)
 			{
-				/* pump file data */
-				while ((rlen = read(fd, buf, sizeof(buf))) > 0)
-					ensure_out(uh_http_send(cl, &cl->request, buf, rlen));
+				/* send whole file as single chunk in chunked mode */
+				if ((cl->request.version > 1.0) && (pi->stat.st_size > 0))
+					ensure_out(uh_http_sendf(cl, NULL, "%llx\r\n",
+											 (unsigned long long)pi->stat.st_size));
+
+				ensure_out(uh_tcp_sendfile(cl, fd, pi->stat.st_size));
+
+				if ((cl->request.version > 1.0) && (pi->stat.st_size > 0))
+					ensure_out(uh_http_send(cl, NULL, "\r\n", -1));
 
 				/* send trailer in chunked mode */
 				ensure_out(uh_http_send(cl, &cl->request, "", 0));
@@ -406,7 +410,7 @@ bool uh_file_request(struct client *cl, struct path_info *pi)
 	}
 
 	/* directory */
-	else if ((pi->stat.st_mode & S_IFDIR) && !cl->server->conf->no_dirlists)
+	else if ((pi->stat.st_mode & S_IFDIR) && !cl->conf->no_dirlists)
 	{
 		/* write status */
 		ensure_out(uh_file_response_200(cl, NULL));
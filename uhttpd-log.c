@@ -0,0 +1,549 @@
+/*
+ * uhttpd - Tiny single-threaded httpd - Access log
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "uhttpd.h"
+#include "uhttpd-utils.h"
+#include "uhttpd-stats.h"
+#include "uhttpd-log.h"
+
+
+static const char *uh_log_formats[] = {
+	[UH_LOG_COMMON]   = "common",
+	[UH_LOG_COMBINED] = "combined",
+	[UH_LOG_JSON]     = "json",
+};
+
+static const char *uh_log_methods[] = {
+	[UH_HTTP_MSG_GET]  = "GET",
+	[UH_HTTP_MSG_HEAD] = "HEAD",
+	[UH_HTTP_MSG_POST] = "POST",
+};
+
+struct uh_log_rec {
+	char buf[UH_LOG_RECORD];
+	int len;
+};
+
+static volatile sig_atomic_t uh_log_rotate = 0;
+
+
+static void uh_log_printf(struct uh_log_rec *r, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(r->buf + r->len, sizeof(r->buf) - r->len, fmt, ap);
+	va_end(ap);
+
+	if (len > 0)
+		r->len = min(r->len + len, sizeof(r->buf) - 1);
+}
+
+/* length of the valid UTF-8 sequence at s, 0 if there is none */
+static int uh_log_utf8(const unsigned char *s)
+{
+	int i, len;
+	unsigned int cp;
+	static const unsigned int min[] = { 0, 0, 0x80, 0x800, 0x10000 };
+
+	if ((s[0] & 0xe0) == 0xc0)
+	{
+		len = 2;
+		cp = s[0] & 0x1f;
+	}
+	else if ((s[0] & 0xf0) == 0xe0)
+	{
+		len = 3;
+		cp = s[0] & 0x0f;
+	}
+	else if ((s[0] & 0xf8) == 0xf0)
+	{
+		len = 4;
+		cp = s[0] & 0x07;
+	}
+	else
+	{
+		return 0;
+	}
+
+	/* stops at the terminating zero as well */
+	for (i = 1; i < len; i++)
+	{
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+
+		cp = (cp << 6) | (s[i] & 0x3f);
+	}
+
+	/* overlong forms, surrogates and anything past U+10FFFF */
+	if ((cp < min[len]) || ((cp >= 0xd800) && (cp <= 0xdfff)) || (cp > 0x10ffff))
+		return 0;
+
+	return len;
+}
+
+/* quoted and escaped Apache style, or as JSON string passing UTF-8 on */
+static void uh_log_string(struct uh_log_rec *r, const char *s, bool json)
+{
+	int n, len;
+	unsigned char c;
+
+	if (!s)
+	{
+		uh_log_printf(r, json ? "null" : "-");
+		return;
+	}
+
+	if (json)
+		uh_log_printf(r, "\"");
+
+	for (n = 0; *s && (n < UH_LOG_FIELD); s++, n++)
+	{
+		c = *s;
+
+		/* leave room for the longest escape and the rest of the record */
+		if (r->len > sizeof(r->buf) - 256)
+			break;
+
+		if ((c == '"') || (c == '\\'))
+			r->len += sprintf(r->buf + r->len, "\\%c", c);
+		else if (json && (c > 0x7f) && (len = uh_log_utf8((const unsigned char *)s)))
+		{
+			/* never cut a sequence in half */
+			if ((n + len) > UH_LOG_FIELD)
+				break;
+
+			memcpy(r->buf + r->len, s, len);
+			r->len += len;
+			s += len - 1;
+			n += len - 1;
+		}
+		else if ((c < 0x20) || (c >= 0x7f))
+			r->len += sprintf(r->buf + r->len,
+							  json ? "\\u%04x" : "\\x%02x", c);
+		else
+			r->buf[r->len++] = c;
+	}
+
+	if (json)
+		uh_log_printf(r, "\"");
+}
+
+static const char * uh_log_time(bool json)
+{
+	static time_t last = 0;
+	static char clf[32], iso[32];
+	time_t now = time(NULL);
+	struct tm tm;
+
+	if (now != last)
+	{
+		localtime_r(&now, &tm);
+		strftime(clf, sizeof(clf), "%d/%b/%Y:%H:%M:%S %z", &tm);
+		strftime(iso, sizeof(iso), "%Y-%m-%dT%H:%M:%S%z", &tm);
+		last = now;
+	}
+
+	return json ? iso : clf;
+}
+
+
+static void uh_log_flush(struct uh_log *log)
+{
+	int rv, len;
+	unsigned int off;
+
+	while ((log->pipe > -1) && (log->tail != log->head))
+	{
+		off = log->tail & (UH_LOG_RING - 1);
+		len = min(log->head - log->tail, UH_LOG_RING - off);
+
+		if ((rv = write(log->pipe, &log->ring[off], len)) > 0)
+		{
+			log->tail += rv;
+			continue;
+		}
+
+		if (errno == EINTR)
+			continue;
+
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			break;
+
+		/* writer is gone, whatever is queued is lost */
+		D("LOG: Writer(%d) lost: %s\n", log->pid, strerror(errno));
+
+		for (; log->tail != log->head; log->tail++)
+			if (log->ring[log->tail & (UH_LOG_RING - 1)] == '\n')
+				log->dropped++;
+
+		close(log->pipe);
+		log->pipe = -1;
+		log->pid  = 0;
+
+		/* records are dropped until a new writer is up */
+		if (!log->respawn.pending)
+			uloop_timeout_set(&log->respawn, UH_LOG_RESPAWN);
+	}
+
+	if ((log->pipe > -1) && (log->tail != log->head))
+		uloop_timeout_set(&log->flush, UH_LOG_INTERVAL);
+}
+
+static void uh_log_flush_cb(struct uloop_timeout *t)
+{
+	uh_log_flush(container_of(t, struct uh_log, flush));
+}
+
+static void uh_log_respawn_cb(struct uloop_timeout *t)
+{
+	struct uh_log *log = container_of(t, struct uh_log, respawn);
+
+	if ((log->pipe < 0) && (uh_log_start(log) < 0))
+	{
+		D("LOG: Unable to respawn writer: %s\n", strerror(errno));
+		uloop_timeout_set(t, UH_LOG_RESPAWN);
+	}
+}
+
+static void uh_log_push(struct uh_log *log, const char *buf, int len)
+{
+	unsigned int off;
+	int part;
+
+	if ((log->pipe < 0) || (UH_LOG_RING - (log->head - log->tail) < len))
+	{
+		log->dropped++;
+		return;
+	}
+
+	off = log->head & (UH_LOG_RING - 1);
+	part = min(len, UH_LOG_RING - off);
+
+	memcpy(&log->ring[off], buf, part);
+	memcpy(log->ring, buf + part, len - part);
+
+	log->head += len;
+	log->records++;
+
+	/* batch up writes, unless the ring is filling up */
+	if (log->head - log->tail > UH_LOG_RING / 2)
+		uh_log_flush(log);
+	else if (!log->flush.pending)
+		uloop_timeout_set(&log->flush, UH_LOG_INTERVAL);
+}
+
+void uh_log_request(struct client *cl)
+{
+	int i;
+	bool json;
+	struct uh_log *log = cl->conf->log;
+	struct http_request *req = &cl->request;
+	struct uh_request_stats *rs = &cl->stats;
+	const char *user = req->realm ? req->realm->user : NULL;
+	const char *referer = NULL, *agent = NULL;
+	struct uh_log_rec r;
+
+	/* connection closed before a request was read */
+	if (!rs->ts[UH_STATS_HEADERS] || !req->url)
+		return;
+
+	foreach_header(i, req->headers)
+	{
+		if (!strcasecmp(req->headers[i], "Referer"))
+			referer = req->headers[i+1];
+		else if (!strcasecmp(req->headers[i], "User-Agent"))
+			agent = req->headers[i+1];
+	}
+
+	r.len = 0;
+	json = (log->format == UH_LOG_JSON);
+
+	if (json)
+	{
+		uh_log_printf(&r, "{\"time\":\"%s\",\"remote_addr\":\"%s\","
+					  "\"remote_user\":", uh_log_time(true),
+					  sa_straddr(&cl->peeraddr));
+		uh_log_string(&r, user, true);
+		uh_log_printf(&r, ",\"method\":\"%s\",\"url\":",
+					  uh_log_methods[req->method]);
+		uh_log_string(&r, req->url, true);
+		uh_log_printf(&r, ",\"protocol\":\"HTTP/%.1f\",\"status\":%d,"
+					  "\"bytes\":%llu,\"duration_us\":%llu,\"referer\":",
+					  req->version, rs->status, rs->bytes,
+					  uh_stats_now() - rs->ts[UH_STATS_ACCEPT]);
+		uh_log_string(&r, referer, true);
+		uh_log_printf(&r, ",\"user_agent\":");
+		uh_log_string(&r, agent, true);
+		uh_log_printf(&r, "}");
+	}
+	else
+	{
+		uh_log_printf(&r, "%s - ", sa_straddr(&cl->peeraddr));
+		uh_log_string(&r, user, false);
+		uh_log_printf(&r, " [%s] \"%s ", uh_log_time(false),
+					  uh_log_methods[req->method]);
+		uh_log_string(&r, req->url, false);
+		uh_log_printf(&r, " HTTP/%.1f\" ", req->version);
+
+		if (rs->status)
+			uh_log_printf(&r, "%d ", rs->status);
+		else
+			uh_log_printf(&r, "- ");
+
+		if (rs->bytes)
+			uh_log_printf(&r, "%llu", rs->bytes);
+		else
+			uh_log_printf(&r, "-");
+
+		if (log->format == UH_LOG_COMBINED)
+		{
+			uh_log_printf(&r, " \"");
+			uh_log_string(&r, referer, false);
+			uh_log_printf(&r, "\" \"");
+			uh_log_string(&r, agent, false);
+			uh_log_printf(&r, "\"");
+		}
+	}
+
+	r.buf[r.len++] = '\n';
+
+	uh_log_push(log, r.buf, r.len);
+}
+
+
+struct uh_log * uh_log_init(const char *spec)
+{
+	int i, len;
+	char *sep, cwd[PATH_MAX];
+	struct uh_log *log;
+
+	if (!(log = calloc(1, sizeof(*log))))
+		return NULL;
+
+	log->file = -1;
+	log->pipe = -1;
+	log->flush.cb = uh_log_flush_cb;
+	log->respawn.cb = uh_log_respawn_cb;
+
+	/* the server chdir()s away when it forks, keep relative paths
+	 * working for reopens */
+	if ((spec[0] != '/') && getcwd(cwd, sizeof(cwd)))
+		len = snprintf(log->path, sizeof(log->path), "%s/%s", cwd, spec);
+	else
+		len = snprintf(log->path, sizeof(log->path), "%s", spec);
+
+	if ((len < 0) || (len >= sizeof(log->path)))
+	{
+		free(log);
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	/* file[:format] */
+	if ((sep = strrchr(log->path, ':')) != NULL)
+	{
+		for (i = 0; i < array_size(uh_log_formats); i++)
+		{
+			if (!strcmp(sep + 1, uh_log_formats[i]))
+			{
+				log->format = i;
+				*sep = 0;
+				break;
+			}
+		}
+	}
+
+	if ((log->file = open(log->path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+	{
+		free(log);
+		return NULL;
+	}
+
+	fd_cloexec(log->file);
+
+	return log;
+}
+
+
+static void uh_log_sigusr1(int sig)
+{
+	uh_log_rotate = 1;
+}
+
+static int uh_log_write(int fd, const char *buf, int len)
+{
+	int rv, off = 0;
+
+	while (off < len)
+	{
+		if ((rv = write(fd, buf + off, len - off)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		off += rv;
+	}
+
+	return off;
+}
+
+/* writer process, copies whole records from the pipe to the log file so
+ * that writers of an old and a new server sharing the file during an
+ * upgrade never interleave within a line */
+static void uh_log_writer(struct uh_log *log, int fd)
+{
+	int rv, end, file;
+	int len = 0;
+	char *buf = log->ring;
+	struct sigaction sa;
+
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGINT,  &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP,  &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+
+	sa.sa_handler = uh_log_sigusr1;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	/* a respawned writer opens the file itself */
+	if ((log->file < 0) &&
+		((log->file = open(log->path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0))
+		_exit(1);
+
+	while (true)
+	{
+		if (uh_log_rotate)
+		{
+			uh_log_rotate = 0;
+
+			if ((file = open(log->path, O_WRONLY | O_CREAT | O_APPEND,
+							 0644)) > -1)
+			{
+				close(log->file);
+				log->file = file;
+			}
+		}
+
+		if ((rv = read(fd, buf + len, UH_LOG_RING - len)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		if (rv == 0)
+			break;
+
+		len += rv;
+
+		for (end = len; (end > 0) && (buf[end - 1] != '\n'); end--);
+
+		if (!end && (len == UH_LOG_RING))
+			end = len;
+
+		uh_log_write(log->file, buf, end);
+
+		memmove(buf, buf + end, len - end);
+		len -= end;
+	}
+
+	if (len > 0)
+		uh_log_write(log->file, buf, len);
+
+	_exit(0);
+}
+
+int uh_log_start(struct uh_log *log)
+{
+	int fd, max_fd, fds[2];
+	pid_t pid;
+
+	if (pipe(fds) < 0)
+		return -1;
+
+	switch ((pid = fork()))
+	{
+		case -1:
+			close(fds[0]);
+			close(fds[1]);
+			return -1;
+
+		case 0:
+			/* drop inherited client and listener sockets, a writer
+			 * respawned at runtime would keep them open otherwise */
+			max_fd = min(sysconf(_SC_OPEN_MAX), 65536);
+
+			for (fd = 3; fd < max_fd; fd++)
+				if ((fd != fds[0]) && (fd != log->file))
+					close(fd);
+
+			uh_log_writer(log, fds[0]);
+	}
+
+	close(fds[0]);
+
+	if (log->file > -1)
+		close(log->file);
+
+	fd_cloexec(fds[1]);
+	fd_nonblock(fds[1]);
+
+	log->file = -1;
+	log->pipe = fds[1];
+	log->pid  = pid;
+
+	D("LOG: Writer(%d) started for %s\n", pid, log->path);
+
+	return 0;
+}
+
+/* called from the SIGUSR1 handler */
+void uh_log_reopen(struct uh_log *log)
+{
+	if (log && (log->pid > 0))
+		kill(log->pid, SIGUSR1);
+}
+
+/* hand over what is left and let the writer drain it */
+void uh_log_close(struct uh_log *log)
+{
+	if (log->flush.pending)
+		uloop_timeout_cancel(&log->flush);
+
+	if (log->respawn.pending)
+		uloop_timeout_cancel(&log->respawn);
+
+	if (log->pipe > -1)
+	{
+		fcntl(log->pipe, F_SETFL, fcntl(log->pipe, F_GETFL) & ~O_NONBLOCK);
+		uh_log_flush(log);
+
+		if (log->pipe > -1)
+			close(log->pipe);
+	}
+
+	log->pipe = -1;
+}
@@ -0,0 +1,67 @@
+/*
+ * uhttpd - Tiny single-threaded httpd - Access log header
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _UHTTPD_LOG_
+
+#define UH_LOG_COMMON		0
+#define UH_LOG_COMBINED		1
+#define UH_LOG_JSON			2
+
+/* records queued in process, must be a power of two */
+#define UH_LOG_RING			(64 * 1024)
+
+/* longest record, longer header values are cut */
+#define UH_LOG_RECORD		4096
+#define UH_LOG_FIELD		1024
+
+/* how often queued records are handed to the writer, in ms */
+#define UH_LOG_INTERVAL		100
+
+/* delay before replacing a writer that went away, in ms */
+#define UH_LOG_RESPAWN		1000
+
+/* records are formatted into a ring by the main loop and pushed to a
+ * forked writer through a non-blocking pipe, so slow storage only ever
+ * costs dropped records, never request latency */
+struct uh_log {
+	char path[PATH_MAX];
+	int format;
+	int file;
+	int pipe;
+	pid_t pid;
+	unsigned int head;
+	unsigned int tail;
+	unsigned long records;
+	unsigned long dropped;
+	struct uloop_timeout flush;
+	struct uloop_timeout respawn;
+	char ring[UH_LOG_RING];
+};
+
+struct uh_log * uh_log_init(const char *spec);
+int uh_log_start(struct uh_log *log);
+void uh_log_reopen(struct uh_log *log);
+void uh_log_close(struct uh_log *log);
+
+void uh_log_request(struct client *cl);
+
+static inline void uh_log_done(struct client *cl)
+{
+	if (cl->conf->log)
+		uh_log_request(cl);
+}
+
+#endif
@@ -20,8 +20,372 @@
 #include "uhttpd.h"
 #include "uhttpd-utils.h"
 #include "uhttpd-lua.h"
+#include "uhttpd-stats.h"
 
 
+static struct {
+	const struct config *conf;
+	lua_State *L;
+	struct uh_lua_worker *workers;
+	struct uloop_timeout spawn;
+} uh_lua_pool;
+
+/* worker process side, socket to the server and pending request body */
+static struct {
+	int fd;
+	int len;
+	int off;
+	bool eof;
+	char buf[UH_LUA_FRAME_MAX];
+} uh_lua_worker_io = { .fd = -1 };
+
+
+static int uh_lua_worker_recv(char *buf, int len, int sec)
+{
+	int rlen;
+
+	while ((uh_lua_worker_io.len <= uh_lua_worker_io.off) &&
+		   !uh_lua_worker_io.eof)
+	{
+		if (!uh_socket_wait(uh_lua_worker_io.fd, sec, false))
+			return -1;
+
+		rlen = recv(uh_lua_worker_io.fd, uh_lua_worker_io.buf,
+					sizeof(uh_lua_worker_io.buf), 0);
+
+		if ((rlen < 0) && (errno == EINTR))
+			continue;
+
+		if ((rlen <= 0) || (uh_lua_worker_io.buf[0] == UH_LUA_FRAME_EOF))
+		{
+			uh_lua_worker_io.eof = true;
+			break;
+		}
+
+		if (uh_lua_worker_io.buf[0] == UH_LUA_FRAME_BODY)
+		{
+			uh_lua_worker_io.off = 1;
+			uh_lua_worker_io.len = rlen;
+		}
+	}
+
+	if (uh_lua_worker_io.len <= uh_lua_worker_io.off)
+		return 0;
+
+	rlen = min(len, uh_lua_worker_io.len - uh_lua_worker_io.off);
+	memcpy(buf, &uh_lua_worker_io.buf[uh_lua_worker_io.off], rlen);
+	uh_lua_worker_io.off += rlen;
+
+	return rlen;
+}
+
+static int uh_lua_worker_send(char type, const char *buf, int len)
+{
+	int rv;
+	int slen = 0;
+	char frame[UH_LUA_FRAME_MAX];
+
+	while (slen < len)
+	{
+		rv = min(len - slen, UH_LUA_FLUSH_MAX);
+
+		frame[0] = type;
+		memcpy(&frame[1], &buf[slen], rv);
+
+		ensure_ret(uh_raw_send(uh_lua_worker_io.fd, frame, rv + 1, -1));
+		slen += rv;
+	}
+
+	return slen;
+}
+
+
+/* in-process handler coroutine being resumed, the allocator limit and the
+ * send and recv functions only apply to it while it runs */
+static struct uh_lua_co *uh_lua_co_current = NULL;
+static struct uh_lua_mem uh_lua_mem;
+
+static int uh_lua_co_recv(struct uh_lua_co *co, char *buf, int len)
+{
+	int rlen;
+	struct client *cl = co->cl;
+
+	if ((len = min(len, co->content_length)) <= 0)
+		return 0;
+
+	/* remaining data in http head buffer ... */
+	if (cl->httpbuf.len > 0)
+	{
+		rlen = min(len, cl->httpbuf.len);
+		memcpy(buf, cl->httpbuf.ptr, rlen);
+
+		cl->httpbuf.len -= rlen;
+		cl->httpbuf.ptr += rlen;
+	}
+
+	/* ... or from the nonblocking socket */
+	else
+	{
+#ifdef HAVE_TLS
+		if (cl->tls)
+			rlen = cl->conf->tls_recv(cl, buf, len);
+		else
+#endif
+			rlen = uh_tcp_recv_lowlevel(cl, buf, len);
+
+		if (rlen < 0)
+			return -1;
+	}
+
+	co->content_length = rlen ? (co->content_length - rlen) : 0;
+
+	return rlen;
+}
+
+static int uh_lua_co_write(struct uh_lua_co *co, const char *buf, int len)
+{
+	int size;
+	char *data;
+
+	/* client went away, discard */
+	if (co->failed)
+		return len;
+
+	if (co->out.len + len > co->out.size)
+	{
+		for (size = co->out.size ? co->out.size : UH_LIMIT_MSGHEAD;
+			 size < co->out.len + len; size *= 2);
+
+		if (!(data = realloc(co->out.data, size)))
+			return -1;
+
+		co->out.data = data;
+		co->out.size = size;
+	}
+
+	memcpy(&co->out.data[co->out.len], buf, len);
+	co->out.len += len;
+	co->data_sent = true;
+
+	return len;
+}
+
+/* returns the number of bytes still pending or -1 on error */
+static int uh_lua_co_flush(struct uh_lua_co *co)
+{
+	int rv;
+	struct client *cl = co->cl;
+
+	while (!co->failed && (co->out.off < co->out.len))
+	{
+#ifdef HAVE_TLS
+		if (cl->tls)
+			rv = cl->conf->tls_send(cl, &co->out.data[co->out.off],
+											co->out.len - co->out.off);
+		else
+#endif
+			rv = uh_tcp_send_lowlevel(cl, &co->out.data[co->out.off],
+									  co->out.len - co->out.off);
+
+		if (rv < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return co->out.len - co->out.off;
+
+			D("Lua: Client(%d) write error: %s\n", cl->fd.fd, strerror(errno));
+			co->failed = true;
+		}
+		else
+		{
+			uh_stats_sent(cl, &co->out.data[co->out.off], rv);
+			co->out.off += rv;
+		}
+	}
+
+	co->out.len = co->out.off = 0;
+
+#ifdef HAVE_TLS
+	/* ... and what the TLS layer held back */
+	if (!co->failed && cl->tls && (cl->conf->tls_flush(cl) < 0))
+	{
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			return 1;
+
+		co->failed = true;
+	}
+#endif
+
+	return co->failed ? -1 : 0;
+}
+
+static int uh_lua_input(char *buf, int len, int sec)
+{
+	int rlen;
+
+	/* nested coroutine of an in-process handler, cannot yield so wait */
+	if (uh_lua_co_current)
+	{
+		while (((rlen = uh_lua_co_recv(uh_lua_co_current, buf, len)) < 0) &&
+			   ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+		{
+			if (!uh_socket_wait(uh_lua_co_current->cl->fd.fd, sec, false))
+				break;
+		}
+
+		return rlen;
+	}
+
+	if (uh_lua_worker_io.fd > -1)
+		return uh_lua_worker_recv(buf, len, sec);
+
+	return uh_raw_recv(fileno(stdin), buf, len, sec);
+}
+
+static int uh_lua_output(const char *buf, int len, int sec)
+{
+	if (uh_lua_co_current)
+		return uh_lua_co_write(uh_lua_co_current, buf, len);
+
+	if (uh_lua_worker_io.fd > -1)
+		return uh_lua_worker_send(UH_LUA_FRAME_DATA, buf, len);
+
+	return uh_raw_send(fileno(stdout), buf, len, sec);
+}
+
+
+/* response of the forked child or worker, in-process handlers have their own */
+static struct uh_lua_resp uh_lua_resp;
+
+static struct uh_lua_resp * uh_lua_resp_current(void)
+{
+	return uh_lua_co_current ? &uh_lua_co_current->resp : &uh_lua_resp;
+}
+
+static void uh_lua_resp_init(struct uh_lua_resp *resp, float version)
+{
+	resp->version = version;
+	resp->managed = resp->flushed = false;
+	resp->head_sent = resp->has_length = resp->chunked = false;
+	resp->hlen = resp->len = 0;
+
+	snprintf(resp->status, sizeof(resp->status), "200 OK");
+}
+
+static int uh_lua_resp_flush(struct uh_lua_resp *resp, bool fin)
+{
+	int plen = 0;
+	char pre[UH_LUA_RESP_HEAD];
+	char *body = &resp->buf[UH_LUA_RESP_HEAD];
+	char *end = &body[resp->len];
+
+	/* headers set through uhttpd.header(), frame the body ourselves */
+	if (resp->managed)
+	{
+		if (!resp->head_sent)
+		{
+			plen = snprintf(pre, sizeof(pre), "HTTP/%.1f %s\r\n%.*s",
+							resp->version, resp->status, resp->hlen, resp->head);
+
+			/* whole response is buffered, announce its length */
+			if (resp->has_length)
+				;
+			else if (fin)
+				plen += snprintf(&pre[plen], sizeof(pre) - plen,
+								 "Content-Length: %d\r\n", resp->len);
+			else if (resp->version > 1.0)
+				plen += snprintf(&pre[plen], sizeof(pre) - plen,
+								 "Transfer-Encoding: chunked\r\n");
+			else
+				plen += snprintf(&pre[plen], sizeof(pre) - plen,
+								 "Connection: close\r\n");
+
+			plen += snprintf(&pre[plen], sizeof(pre) - plen, "\r\n");
+
+			resp->chunked = !resp->has_length && !fin && (resp->version > 1.0);
+			resp->head_sent = true;
+		}
+
+		if (resp->chunked)
+		{
+			if (resp->len > 0)
+			{
+				plen += snprintf(&pre[plen], sizeof(pre) - plen,
+								 "%X\r\n", resp->len);
+
+				memcpy(end, "\r\n", 2);
+				end += 2;
+			}
+
+			if (fin)
+			{
+				memcpy(end, "0\r\n\r\n", 5);
+				end += 5;
+			}
+		}
+	}
+
+	memcpy(body - plen, pre, plen);
+	body -= plen;
+
+	resp->len = 0;
+
+	if (end > body)
+	{
+		resp->flushed = true;
+		return uh_lua_output(body, end - body, 1);
+	}
+
+	return 0;
+}
+
+static int uh_lua_resp_write(struct uh_lua_resp *resp, const char *buf, int len)
+{
+	int rv;
+	int slen = 0;
+
+	while (slen < len)
+	{
+		if (resp->len >= UH_LUA_OUTBUF)
+			ensure_ret(uh_lua_resp_flush(resp, false));
+
+		rv = min(len - slen, UH_LUA_OUTBUF - resp->len);
+		memcpy(&resp->buf[UH_LUA_RESP_HEAD + resp->len], &buf[slen], rv);
+
+		resp->len += rv;
+		slen += rv;
+	}
+
+	return slen;
+}
+
+static int uh_lua_recv_result(lua_State *L, const char *buffer, int rlen)
+{
+	/* data read */
+	if (rlen > 0)
+	{
+		lua_pushnumber(L, rlen);
+		lua_pushlstring(L, buffer, rlen);
+		return 2;
+	}
+
+	/* eof */
+	else if (rlen == 0)
+	{
+		lua_pushnumber(L, 0);
+		return 1;
+	}
+
+	/* no, timeout and actually no data */
+	else
+	{
+		lua_pushnumber(L, -1);
+		return 1;
+	}
+}
+
 static int uh_lua_recv(lua_State *L)
 {
 	size_t length;
@@ -29,37 +393,34 @@ static int uh_lua_recv(lua_State *L)
 	char buffer[UH_LIMIT_MSGHEAD];
 
 	int to = 1;
-	int fd = fileno(stdin);
 	int rlen = 0;
 
+	struct uh_lua_co *co = uh_lua_co_current;
+
 	length = luaL_checknumber(L, 1);
 
 	if ((length > 0) && (length <= sizeof(buffer)))
 	{
-		/* receive data */
-		rlen = uh_raw_recv(fd, buffer, length, to);
-
-		/* data read */
-		if (rlen > 0)
+		/* in-process handler, suspend until the client sent more data */
+		if (co && (co->L == L))
 		{
-			lua_pushnumber(L, rlen);
-			lua_pushlstring(L, buffer, rlen);
-			return 2;
-		}
+			rlen = uh_lua_co_recv(co, buffer, length);
 
-		/* eof */
-		else if (rlen == 0)
-		{
-			lua_pushnumber(L, 0);
-			return 1;
+			if ((rlen < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+			{
+				co->wait = UH_LUA_CO_RECV;
+				co->wait_len = length;
+				return lua_yield(L, 0);
+			}
 		}
 
-		/* no, timeout and actually no data */
+		/* receive data */
 		else
 		{
-			lua_pushnumber(L, -1);
-			return 1;
+			rlen = uh_lua_input(buffer, length, to);
 		}
+
+		return uh_lua_recv_result(L, buffer, rlen);
 	}
 
 	/* parameter error */
@@ -75,38 +436,57 @@ static int uh_lua_send_common(lua_State *L, int chunked)
 	const char *buffer;
 
 	int rv;
-	int to = 1;
-	int fd = fileno(stdout);
 	int slen = 0;
 
+	struct uh_lua_co *co = uh_lua_co_current;
+	struct uh_lua_resp *resp = uh_lua_resp_current();
+
 	buffer = luaL_checklstring(L, 1, &length);
 
-	if (chunked)
+	/* managed responses are framed on flush */
+	if (chunked && !resp->managed)
 	{
 		if (length > 0)
 		{
 			snprintf(chunk, sizeof(chunk), "%X\r\n", length);
 
-			ensure_out(rv = uh_raw_send(fd, chunk, strlen(chunk), to));
+			ensure_out(rv = uh_lua_resp_write(resp, chunk, strlen(chunk)));
 			slen += rv;
 
-			ensure_out(rv = uh_raw_send(fd, buffer, length, to));
+			ensure_out(rv = uh_lua_resp_write(resp, buffer, length));
 			slen += rv;
 
-			ensure_out(rv = uh_raw_send(fd, "\r\n", 2, to));
+			ensure_out(rv = uh_lua_resp_write(resp, "\r\n", 2));
 			slen += rv;
 		}
 		else
 		{
-			slen = uh_raw_send(fd, "0\r\n\r\n", 5, to);
+			slen = uh_lua_resp_write(resp, "0\r\n\r\n", 5);
 		}
 	}
 	else
 	{
-		slen = uh_raw_send(fd, buffer, length, to);
+		slen = uh_lua_resp_write(resp, buffer, length);
 	}
 
 out:
+	/* in-process handler, suspend while the client lags behind */
+	if (co && ((co->out.len - co->out.off) > UH_LUA_CO_OUTBUF) &&
+		(uh_lua_co_flush(co) > UH_LUA_CO_OUTBUF))
+	{
+		if (co->L == L)
+		{
+			co->wait = UH_LUA_CO_SEND;
+			co->wait_len = slen;
+			return lua_yield(L, 0);
+		}
+
+		/* nested coroutine, cannot yield so wait */
+		while ((uh_lua_co_flush(co) > 0) &&
+			   uh_socket_wait(co->cl->fd.fd,
+							  co->cl->conf->network_timeout, true));
+	}
+
 	lua_pushnumber(L, slen);
 	return 1;
 }
@@ -121,6 +501,46 @@ static int uh_lua_sendc(lua_State *L)
 	return uh_lua_send_common(L, 1);
 }
 
+static int uh_lua_header(lua_State *L)
+{
+	size_t nlen, vlen;
+	const char *name = luaL_checklstring(L, 1, &nlen);
+	const char *value = luaL_checklstring(L, 2, &vlen);
+
+	struct uh_lua_resp *resp = uh_lua_resp_current();
+
+	if (resp->head_sent || (!resp->managed && (resp->flushed || resp->len)))
+		return luaL_error(L, "response header already sent");
+
+	/* no header or response splitting */
+	if (!nlen || (strcspn(name, "\r\n:") != nlen))
+		return luaL_error(L, "invalid header name");
+
+	if (strcspn(value, "\r\n") != vlen)
+		return luaL_error(L, "invalid header value");
+
+	resp->managed = true;
+
+	/* CGI style status header */
+	if (!strcasecmp(name, "Status"))
+	{
+		snprintf(resp->status, sizeof(resp->status), "%s", value);
+		return 0;
+	}
+
+	if (!strcasecmp(name, "Content-Length"))
+		resp->has_length = true;
+
+	if ((resp->hlen + nlen + vlen + 4) >= sizeof(resp->head))
+		return luaL_error(L, "response header too large");
+
+	resp->hlen += snprintf(&resp->head[resp->hlen],
+						   sizeof(resp->head) - resp->hlen,
+						   "%s: %s\r\n", name, value);
+
+	return 0;
+}
+
 static int uh_lua_str2str(lua_State *L, int (*xlate_func) (char *, int, const char *, int))
 {
 	size_t inlen;
@@ -150,72 +570,318 @@ static int uh_lua_urlencode(lua_State *L)
 }
 
 
-lua_State * uh_lua_init(const struct config *conf)
+static void * uh_lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
 {
-	lua_State *L = lua_open();
-	const char *err_str = NULL;
+	struct uh_lua_mem *mem = (struct uh_lua_mem *)ud;
 
-	/* Load standard libaries */
-	luaL_openlibs(L);
+	if (nsize == 0)
+	{
+		free(ptr);
+		mem->used -= osize;
+		return NULL;
+	}
 
-	/* build uhttpd api table */
-	lua_newtable(L);
+	/* only growth of a running in-process handler is refused, Lua does
+	 * not expect shrinking to fail */
+	if (mem->limit && uh_lua_co_current && (nsize > osize) &&
+		((mem->used + nsize - osize) > mem->limit))
+		return NULL;
 
-	/* register global send and receive functions */
-	lua_pushcfunction(L, uh_lua_recv);
-	lua_setfield(L, -2, "recv");
+	if ((ptr = realloc(ptr, nsize)) != NULL)
+		mem->used += nsize - osize;
 
-	lua_pushcfunction(L, uh_lua_send);
-	lua_setfield(L, -2, "send");
+	return ptr;
+}
 
-	lua_pushcfunction(L, uh_lua_sendc);
-	lua_setfield(L, -2, "sendc");
+static int uh_lua_panic(lua_State *L)
+{
+	fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+			lua_tostring(L, -1));
 
-	lua_pushcfunction(L, uh_lua_urldecode);
-	lua_setfield(L, -2, "urldecode");
+	return 0;
+}
 
-	lua_pushcfunction(L, uh_lua_urlencode);
-	lua_setfield(L, -2, "urlencode");
+static int uh_lua_cache_path(char *buf, int len, const char *path)
+{
+	int rv;
+	struct stat s;
+	char real[PATH_MAX];
 
-	/* Pass the document-root to the Lua handler by placing it in
-	** uhttpd.docroot.  It could alternatively be placed in env.DOCUMENT_ROOT
-	** which would more closely resemble the CGI protocol; but would mean that
-	** it is not available at the time when the handler-chunk is loaded but
-	** rather not until the handler is called, without any code savings. */
-	lua_pushstring(L, conf->docroot);
-	lua_setfield(L, -2, "docroot");
+	/* refuse a cache directory others could plant bytecode in */
+	if ((mkdir(UH_LUA_CACHE_DIR, 0700) && (errno != EEXIST)) ||
+		lstat(UH_LUA_CACHE_DIR, &s) || !S_ISDIR(s.st_mode) ||
+		(s.st_uid != geteuid()) || (s.st_mode & (S_IWGRP | S_IWOTH)))
+		return -1;
 
-	/* _G.uhttpd = { ... } */
-	lua_setfield(L, LUA_GLOBALSINDEX, "uhttpd");
+	if (realpath(path, real))
+		path = real;
 
+	rv = snprintf(buf, len, "%s/", UH_LUA_CACHE_DIR);
 
-	/* load Lua handler */
-	switch (luaL_loadfile(L, conf->lua_handler))
+	if ((len = uh_urlencode(&buf[rv], len - rv - 16, path, strlen(path))) < 0)
+		return -1;
+
+	buf[rv + len] = 0;
+	return 0;
+}
+
+static int uh_lua_cache_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+	return (fwrite(p, 1, sz, (FILE *)ud) != sz);
+}
+
+/* like luaL_loadfile() but go through the bytecode cache */
+static int uh_lua_load_cached(lua_State *L, const char *path)
+{
+	int fd, rv;
+	bool ok;
+	FILE *f;
+	char *data;
+	struct stat s, cs;
+	struct uh_lua_cache_hdr hdr;
+	char cache[PATH_MAX], tmp[PATH_MAX], chunkname[PATH_MAX + 1];
+
+	if (stat(path, &s) || uh_lua_cache_path(cache, sizeof(cache), path))
+		return luaL_loadfile(L, path);
+
+	/* cached bytecode of the same source revision */
+	if ((fd = open(cache, O_RDONLY)) > -1)
 	{
-		case LUA_ERRSYNTAX:
-			fprintf(stderr,
-					"Lua handler contains syntax errors, unable to continue\n");
-			exit(1);
+		if (!fstat(fd, &cs) && (cs.st_uid == geteuid()) &&
+			!(cs.st_mode & (S_IWGRP | S_IWOTH)) &&
+			(cs.st_size > sizeof(hdr)) &&
+			(read(fd, &hdr, sizeof(hdr)) == sizeof(hdr)) &&
+			!memcmp(hdr.magic, UH_LUA_CACHE_MAGIC, sizeof(hdr.magic)) &&
+			(hdr.mtime == s.st_mtime) && (hdr.size == s.st_size) &&
+			((data = mmap(NULL, cs.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+			 != MAP_FAILED))
+		{
+			snprintf(chunkname, sizeof(chunkname), "@%s", path);
 
-		case LUA_ERRMEM:
-			fprintf(stderr,
-					"Lua handler ran out of memory, unable to continue\n");
-			exit(1);
+			rv = luaL_loadbuffer(L, data + sizeof(hdr),
+								 cs.st_size - sizeof(hdr), chunkname);
 
-		case LUA_ERRFILE:
-			fprintf(stderr,
-					"Lua cannot open the handler script, unable to continue\n");
-			exit(1);
+			munmap(data, cs.st_size);
+			close(fd);
 
-		default:
-			/* compile Lua handler */
-			switch (lua_pcall(L, 0, 0, 0))
+			if (!rv)
 			{
-				case LUA_ERRRUN:
-					err_str = luaL_checkstring(L, -1);
-					fprintf(stderr,
-							"Lua handler had runtime error, "
-							"unable to continue\n"
+				D("Lua: Loaded %s from bytecode cache\n", path);
+				return 0;
+			}
+
+			/* stale or foreign bytecode, recompile */
+			lua_pop(L, 1);
+		}
+		else
+		{
+			close(fd);
+		}
+	}
+
+	if ((rv = luaL_loadfile(L, path)) != 0)
+		return rv;
+
+	/* dump compiled chunk, replace cache entry atomically, skip caching
+	 * if the temporary name does not fit */
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", cache, getpid()) >= sizeof(tmp))
+		return 0;
+
+	if (((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0) ||
+		!(f = fdopen(fd, "w")))
+	{
+		if (fd > -1)
+		{
+			close(fd);
+			unlink(tmp);
+		}
+
+		return 0;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, UH_LUA_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.mtime = s.st_mtime;
+	hdr.size = s.st_size;
+
+	ok = (fwrite(&hdr, sizeof(hdr), 1, f) == 1) &&
+		!lua_dump(L, uh_lua_cache_writer, f);
+
+	ok = !fclose(f) && ok;
+
+	if (!ok || rename(tmp, cache))
+		unlink(tmp);
+
+	return 0;
+}
+
+/* replacement for the package.path searcher of require() */
+static int uh_lua_loader(lua_State *L)
+{
+	int n = 0;
+	int len, plen;
+	const char *name, *path, *next, *mark;
+	char file[PATH_MAX];
+
+	luaL_checkstring(L, 1);
+	name = luaL_gsub(L, lua_tostring(L, 1), ".", "/");
+
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "path");
+
+	if (!(path = lua_tostring(L, -1)))
+		return luaL_error(L, "'package.path' must be a string");
+
+	for (; *path; path = *next ? next + 1 : next)
+	{
+		if (!(next = strchr(path, ';')))
+			next = path + strlen(path);
+
+		if ((plen = next - path) == 0)
+			continue;
+
+		/* substitute the first "?" with the module path */
+		if ((mark = memchr(path, '?', plen)) != NULL)
+			len = snprintf(file, sizeof(file), "%.*s%s%.*s",
+						   (int)(mark - path), path, name,
+						   (int)(next - mark - 1), mark + 1);
+		else
+			len = snprintf(file, sizeof(file), "%.*s", plen, path);
+
+		if ((len >= sizeof(file)) || access(file, R_OK))
+		{
+			lua_pushfstring(L, "\n\tno file '%s'", file);
+			n++;
+			continue;
+		}
+
+		if (uh_lua_load_cached(L, file))
+			return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s",
+							  lua_tostring(L, 1), file, lua_tostring(L, -1));
+
+		return 1;
+	}
+
+	lua_concat(L, n);
+	return 1;
+}
+
+static void uh_lua_preload(lua_State *L, const char *list)
+{
+	char *mods, *mod, *sp = NULL;
+
+	if (!(mods = strdup(list)))
+		return;
+
+	for (mod = strtok_r(mods, ", ", &sp); mod; mod = strtok_r(NULL, ", ", &sp))
+	{
+		lua_getglobal(L, "require");
+		lua_pushstring(L, mod);
+
+		if (lua_pcall(L, 1, 0, 0))
+		{
+			fprintf(stderr, "Notice: Unable to preload Lua module %s: %s\n",
+					mod, lua_tostring(L, -1));
+
+			lua_pop(L, 1);
+		}
+	}
+
+	free(mods);
+}
+
+static void uh_lua_worker_spawn_cb(struct uloop_timeout *t);
+
+lua_State * uh_lua_init(const struct config *conf)
+{
+	int i;
+	lua_State *L;
+	const char *err_str = NULL;
+
+	/* cap the heap of in-process handlers */
+	if (conf->lua_inproc && (conf->lua_memory > 0))
+		uh_lua_mem.limit = (size_t)conf->lua_memory * 1024;
+
+	if (!(L = lua_newstate(uh_lua_alloc, &uh_lua_mem)))
+	{
+		fprintf(stderr,
+				"Unable to create Lua state, unable to continue\n");
+		exit(1);
+	}
+
+	lua_atpanic(L, uh_lua_panic);
+
+	/* Load standard libaries */
+	luaL_openlibs(L);
+
+	/* let require() load modules through the bytecode cache */
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "loaders");
+	lua_pushcfunction(L, uh_lua_loader);
+	lua_rawseti(L, -2, 2);
+	lua_pop(L, 2);
+
+	/* build uhttpd api table */
+	lua_newtable(L);
+
+	/* register global send and receive functions */
+	lua_pushcfunction(L, uh_lua_recv);
+	lua_setfield(L, -2, "recv");
+
+	lua_pushcfunction(L, uh_lua_send);
+	lua_setfield(L, -2, "send");
+
+	lua_pushcfunction(L, uh_lua_sendc);
+	lua_setfield(L, -2, "sendc");
+
+	lua_pushcfunction(L, uh_lua_header);
+	lua_setfield(L, -2, "header");
+
+	lua_pushcfunction(L, uh_lua_urldecode);
+	lua_setfield(L, -2, "urldecode");
+
+	lua_pushcfunction(L, uh_lua_urlencode);
+	lua_setfield(L, -2, "urlencode");
+
+	/* Pass the document-root to the Lua handler by placing it in
+	** uhttpd.docroot.  It could alternatively be placed in env.DOCUMENT_ROOT
+	** which would more closely resemble the CGI protocol; but would mean that
+	** it is not available at the time when the handler-chunk is loaded but
+	** rather not until the handler is called, without any code savings. */
+	lua_pushstring(L, conf->docroot);
+	lua_setfield(L, -2, "docroot");
+
+	/* _G.uhttpd = { ... } */
+	lua_setfield(L, LUA_GLOBALSINDEX, "uhttpd");
+
+
+	/* load Lua handler */
+	switch (uh_lua_load_cached(L, conf->lua_handler))
+	{
+		case LUA_ERRSYNTAX:
+			fprintf(stderr,
+					"Lua handler contains syntax errors, unable to continue\n");
+			exit(1);
+
+		case LUA_ERRMEM:
+			fprintf(stderr,
+					"Lua handler ran out of memory, unable to continue\n");
+			exit(1);
+
+		case LUA_ERRFILE:
+			fprintf(stderr,
+					"Lua cannot open the handler script, unable to continue\n");
+			exit(1);
+
+		default:
+			/* compile Lua handler */
+			switch (lua_pcall(L, 0, 0, 0))
+			{
+				case LUA_ERRRUN:
+					err_str = luaL_checkstring(L, -1);
+					fprintf(stderr,
+							"Lua handler had runtime error, "
+							"unable to continue\n"
 							"Error: %s\n", err_str);
 					exit(1);
 
@@ -246,6 +912,32 @@ lua_State * uh_lua_init(const struct config *conf)
 			break;
 	}
 
+	/* parse modules once in the parent, children inherit them */
+	if (conf->lua_preload)
+		uh_lua_preload(L, conf->lua_preload);
+
+	uh_lua_pool.conf = conf;
+	uh_lua_pool.L = L;
+
+	/* set up worker pool, processes are spawned from within the main loop
+	 * so that they become children of the daemonized server */
+	if (conf->lua_workers > 0)
+	{
+		if (!(uh_lua_pool.workers = calloc(conf->lua_workers,
+										   sizeof(struct uh_lua_worker))))
+		{
+			fprintf(stderr,
+					"Unable to allocate Lua worker pool, unable to continue\n");
+			exit(1);
+		}
+
+		for (i = 0; i < conf->lua_workers; i++)
+			uh_lua_pool.workers[i].fd = -1;
+
+		uh_lua_pool.spawn.cb = uh_lua_worker_spawn_cb;
+		uloop_timeout_set(&uh_lua_pool.spawn, 0);
+	}
+
 	return L;
 }
 
@@ -259,7 +951,7 @@ static void uh_lua_shutdown(struct uh_lua_state *state)
 static bool uh_lua_socket_cb(struct client *cl)
 {
 	int len;
-	char buf[UH_LIMIT_MSGHEAD];
+	char buf[UH_LUA_FLUSH_MAX];
 
 	struct uh_lua_state *state = (struct uh_lua_state *)cl->priv;
 
@@ -274,95 +966,602 @@ static bool uh_lua_socket_cb(struct client *cl)
 			D("Lua: Child(%d) feed %d HTTP buffer bytes\n",
 			  state->cl->proc.pid, len);
 
-			memcpy(buf, state->cl->httpbuf.ptr, len);
+			memcpy(buf, state->cl->httpbuf.ptr, len);
+
+			state->cl->httpbuf.len -= len;
+			state->cl->httpbuf.ptr += len;
+		}
+
+		/* read it from socket ... */
+		else
+		{
+			len = uh_tcp_recv(state->cl, buf,
+							  min(state->content_length, sizeof(buf)));
+
+			if ((len < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+				break;
+
+			D("Lua: Child(%d) feed %d/%d TCP socket bytes\n",
+			  state->cl->proc.pid, len,
+			  min(state->content_length, sizeof(buf)));
+		}
+
+		if (len)
+			state->content_length -= len;
+		else
+			state->content_length = 0;
+
+		/* ... write to Lua process */
+		len = uh_raw_send(state->wfd, buf, len,
+						  cl->conf->script_timeout);
+
+		/* explicit EOF notification for the child */
+		if (state->content_length <= 0)
+			close(state->wfd);
+	}
+
+	/* try to read data from child */
+	while ((len = uh_raw_recv(state->rfd, buf, sizeof(buf), -1)) > 0)
+	{
+		/* pass through buffer to socket */
+		D("Lua: Child(%d) relaying %d normal bytes\n", state->cl->proc.pid, len);
+		ensure_out(uh_tcp_send(state->cl, buf, len));
+		state->data_sent = true;
+	}
+
+	/* got EOF or read error from child */
+	if ((len == 0) ||
+		((errno != EAGAIN) && (errno != EWOULDBLOCK) && (len == -1)))
+	{
+		D("Lua: Child(%d) presumed dead [%s]\n",
+		  state->cl->proc.pid, strerror(errno));
+
+		goto out;
+	}
+
+	/* child is idle, do not hold back buffered output */
+	ensure_out(uh_tcp_flush(state->cl));
+
+	return true;
+
+out:
+	if (!state->data_sent)
+	{
+		if (state->cl->timeout.pending)
+			uh_http_sendhf(state->cl, 502, "Bad Gateway",
+						   "The Lua process did not produce any response\n");
+		else
+			uh_http_sendhf(state->cl, 504, "Gateway Timeout",
+						   "The Lua process took too long to produce a "
+						   "response\n");
+	}
+
+	uh_lua_shutdown(state);
+	return false;
+}
+
+static void uh_lua_push_env(lua_State *L, const struct config *conf,
+							struct http_request *req,
+							struct sockaddr_in6 *peeraddr,
+							struct sockaddr_in6 *servaddr,
+							int content_length)
+{
+	int i;
+	char *query_string;
+	const char *prefix = conf->lua_prefix;
+
+	/* build env table */
+	lua_newtable(L);
+
+	/* request method */
+	switch(req->method)
+	{
+		case UH_HTTP_MSG_GET:
+			lua_pushstring(L, "GET");
+			break;
+
+		case UH_HTTP_MSG_HEAD:
+			lua_pushstring(L, "HEAD");
+			break;
+
+		case UH_HTTP_MSG_POST:
+			lua_pushstring(L, "POST");
+			break;
+	}
+
+	lua_setfield(L, -2, "REQUEST_METHOD");
+
+	/* request url */
+	lua_pushstring(L, req->url);
+	lua_setfield(L, -2, "REQUEST_URI");
+
+	/* script name */
+	lua_pushstring(L, conf->lua_prefix);
+	lua_setfield(L, -2, "SCRIPT_NAME");
+
+	/* query string, path info */
+	if ((query_string = strchr(req->url, '?')) != NULL)
+	{
+		lua_pushstring(L, query_string + 1);
+		lua_setfield(L, -2, "QUERY_STRING");
+
+		if ((int)(query_string - req->url) > strlen(prefix))
+		{
+			lua_pushlstring(L,
+				&req->url[strlen(prefix)],
+				(int)(query_string - req->url) - strlen(prefix)
+			);
+
+			lua_setfield(L, -2, "PATH_INFO");
+		}
+	}
+	else if (strlen(req->url) > strlen(prefix))
+	{
+		lua_pushstring(L, &req->url[strlen(prefix)]);
+		lua_setfield(L, -2, "PATH_INFO");
+	}
+
+	/* http protcol version */
+	lua_pushnumber(L, floor(req->version * 10) / 10);
+	lua_setfield(L, -2, "HTTP_VERSION");
+
+	if (req->version > 1.0)
+		lua_pushstring(L, "HTTP/1.1");
+	else
+		lua_pushstring(L, "HTTP/1.0");
+
+	lua_setfield(L, -2, "SERVER_PROTOCOL");
+
+
+	/* address information */
+	lua_pushstring(L, sa_straddr(peeraddr));
+	lua_setfield(L, -2, "REMOTE_ADDR");
+
+	lua_pushinteger(L, sa_port(peeraddr));
+	lua_setfield(L, -2, "REMOTE_PORT");
+
+	lua_pushstring(L, sa_straddr(servaddr));
+	lua_setfield(L, -2, "SERVER_ADDR");
+
+	lua_pushinteger(L, sa_port(servaddr));
+	lua_setfield(L, -2, "SERVER_PORT");
+
+	/* essential env vars */
+	foreach_header(i, req->headers)
+	{
+		if (!strcasecmp(req->headers[i], "Content-Length"))
+		{
+			content_length = atoi(req->headers[i+1]);
+		}
+		else if (!strcasecmp(req->headers[i], "Content-Type"))
+		{
+			lua_pushstring(L, req->headers[i+1]);
+			lua_setfield(L, -2, "CONTENT_TYPE");
+		}
+	}
+
+	lua_pushnumber(L, content_length);
+	lua_setfield(L, -2, "CONTENT_LENGTH");
+
+	/* misc. headers */
+	lua_newtable(L);
+
+	foreach_header(i, req->headers)
+	{
+		if( strcasecmp(req->headers[i], "Content-Length") &&
+			strcasecmp(req->headers[i], "Content-Type"))
+		{
+			lua_pushstring(L, req->headers[i+1]);
+			lua_setfield(L, -2, req->headers[i]);
+		}
+	}
+
+	lua_setfield(L, -2, "headers");
+}
+
+static void uh_lua_error(struct uh_lua_resp *resp, const char *err_str)
+{
+	int len;
+	char buf[UH_LIMIT_MSGHEAD];
+
+	if (! err_str)
+		err_str = "Unknown error";
+
+	/* nothing went out yet, replace the buffered response */
+	if (!resp->flushed)
+		uh_lua_resp_init(resp, resp->version);
+	else
+		uh_lua_resp_flush(resp, false);
+
+	len = snprintf(buf, sizeof(buf),
+				   "HTTP/%.1f 500 Internal Server Error\r\n"
+				   "Connection: close\r\n"
+				   "Content-Type: text/plain\r\n"
+				   "Content-Length: %i\r\n\r\n"
+				   "Lua raised a runtime error:\n  %s\n",
+				   resp->version, 31 + strlen(err_str), err_str);
+
+	uh_lua_output(buf, min(len, sizeof(buf) - 1), 1);
+}
+
+static void uh_lua_call(lua_State *L, const struct config *conf,
+						struct http_request *req,
+						struct sockaddr_in6 *peeraddr,
+						struct sockaddr_in6 *servaddr,
+						int content_length)
+{
+	const char *err_str = NULL;
+
+	struct uh_lua_resp *resp = uh_lua_resp_current();
+
+	uh_lua_resp_init(resp, req->version);
+
+	/* put handler callback on stack */
+	lua_getglobal(L, UH_LUA_CALLBACK);
+
+	uh_lua_push_env(L, conf, req, peeraddr, servaddr, content_length);
+
+	/* call */
+	switch (lua_pcall(L, 1, 0, 0))
+	{
+		case LUA_ERRMEM:
+		case LUA_ERRRUN:
+			err_str = luaL_checkstring(L, -1);
+
+			uh_lua_error(resp, err_str);
+			lua_pop(L, 1);
+			break;
+
+		default:
+			uh_lua_resp_flush(resp, true);
+			break;
+	}
+}
+
+
+static void uh_lua_worker_spawn(struct uh_lua_worker *w);
+static void uh_lua_worker_respawn(struct uh_lua_worker *w);
+
+static void uh_lua_worker_main(struct uh_lua_worker *w)
+{
+	int i, len;
+	int base = lua_gc(uh_lua_pool.L, LUA_GCCOUNT, 0);
+	char *strings, *end;
+	char buf[UH_LUA_FRAME_MAX];
+	char fin[2] = { UH_LUA_FRAME_END, 0 };
+
+	const struct config *conf = uh_lua_pool.conf;
+	struct uh_lua_wire_req *wire = (struct uh_lua_wire_req *)&buf[1];
+	struct http_request req;
+
+	while (!fin[1])
+	{
+		/* wait for the next request head, skip stale body frames */
+		do {
+			len = recv(uh_lua_worker_io.fd, buf, sizeof(buf), 0);
+		} while (((len < 0) && (errno == EINTR)) ||
+				 ((len > 0) && (buf[0] != UH_LUA_FRAME_REQ)));
+
+		if (len < (int)(sizeof(*wire) + 2))
+			break;
+
+		/* unpack url and header strings */
+		memset(&req, 0, sizeof(req));
+		req.method  = wire->method;
+		req.version = wire->version;
+
+		strings = (char *)&wire[1];
+		end = &buf[len];
+		end[-1] = 0;
+
+		for (i = 0; (i < wire->n_strings) && (strings < end); i++)
+		{
+			if (i == 0)
+				req.url = strings;
+			else if (i <= array_size(req.headers))
+				req.headers[i-1] = strings;
+
+			strings += strlen(strings) + 1;
+		}
+
+		if (!req.url)
+			break;
+
+		uh_lua_worker_io.len = uh_lua_worker_io.off = 0;
+		uh_lua_worker_io.eof = (wire->body_length <= 0);
+
+		uh_lua_call(uh_lua_pool.L, conf, &req,
+					&wire->peeraddr, &wire->servaddr, wire->content_length);
+
+		/* ask to be recycled after too many requests or heap growth */
+		fin[1] = (++w->requests >= conf->lua_worker_requests) ||
+			((lua_gc(uh_lua_pool.L, LUA_GCCOUNT, 0) - base) >
+			 conf->lua_worker_memory);
+
+		if (uh_raw_send(uh_lua_worker_io.fd, fin, sizeof(fin), -1) < 0)
+			break;
+	}
+
+	exit(0);
+}
+
+static void uh_lua_worker_cb(struct uloop_process *p, int rv)
+{
+	struct uh_lua_worker *w = container_of(p, struct uh_lua_worker, proc);
+
+	D("Lua: Worker(%d) exited\n", w->proc.pid);
+
+	w->proc.pid = 0;
+
+	/* a client still relays from this worker, respawn once it let go */
+	if (w->busy)
+	{
+		w->retiring = true;
+		return;
+	}
+
+	uh_lua_worker_respawn(w);
+}
+
+/* replace a worker right away unless its slot was spawned too recently,
+ * in which case the pool timer retries later */
+static void uh_lua_worker_respawn(struct uh_lua_worker *w)
+{
+	if ((uh_stats_now() - w->spawned) >= (UH_LUA_WORKER_BACKOFF * 1000ULL))
+		uh_lua_worker_spawn(w);
+	else if (!uh_lua_pool.spawn.pending)
+		uloop_timeout_set(&uh_lua_pool.spawn, UH_LUA_WORKER_BACKOFF);
+}
+
+static void uh_lua_worker_spawn(struct uh_lua_worker *w)
+{
+	int fd, max_fd;
+	int sv[2];
+	pid_t child;
+
+	if (w->fd > -1)
+		close(w->fd);
+
+	w->fd = -1;
+	w->busy = false;
+	w->retiring = false;
+	w->requests = 0;
+	w->spawned = uh_stats_now();
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+	{
+		D("Lua: Unable to create worker socket: %s\n", strerror(errno));
+		uh_lua_worker_respawn(w);
+		return;
+	}
+
+	switch ((child = fork()))
+	{
+	case -1:
+		D("Lua: Unable to fork worker: %s\n", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		uh_lua_worker_respawn(w);
+		return;
+
+	case 0:
+		/* drop inherited client and listener sockets, they must not be
+		 * kept open past their lifetime in the server process */
+		max_fd = min(sysconf(_SC_OPEN_MAX), 65536);
+
+		for (fd = 3; fd < max_fd; fd++)
+			if (fd != sv[1])
+				close(fd);
+
+		uh_lua_worker_io.fd = sv[1];
+		uh_lua_worker_main(w);
+		exit(0);
+
+	default:
+		close(sv[1]);
+
+		w->fd = sv[0];
+		fd_nonblock(w->fd);
+		fd_cloexec(w->fd);
+
+		w->proc.pid = child;
+		w->proc.cb = uh_lua_worker_cb;
+		uloop_process_add(&w->proc);
+
+		D("Lua: Worker(%d) spawned: fd(%d)\n", child, w->fd);
+		break;
+	}
+}
+
+static void uh_lua_worker_spawn_cb(struct uloop_timeout *t)
+{
+	int i;
+	struct uh_lua_worker *w;
+
+	for (i = 0; i < uh_lua_pool.conf->lua_workers; i++)
+	{
+		w = &uh_lua_pool.workers[i];
+
+		/* slots still relaying a dead worker are respawned on release */
+		if (!w->proc.pid && !w->busy)
+			uh_lua_worker_respawn(w);
+	}
+}
+
+static struct uh_lua_worker * uh_lua_worker_get(void)
+{
+	int i;
+	struct uh_lua_worker *w;
+
+	for (i = 0; i < uh_lua_pool.conf->lua_workers; i++)
+	{
+		w = &uh_lua_pool.workers[i];
+
+		if (w->proc.pid && (w->fd > -1) && !w->busy && !w->retiring)
+			return w;
+	}
+
+	return NULL;
+}
+
+static void uh_lua_worker_put(struct uh_lua_worker *w, bool clean)
+{
+	w->busy = false;
+
+	/* worker is in an unknown state, do not hand it another request */
+	if (!clean)
+	{
+		w->retiring = true;
+
+		if (w->proc.pid)
+			kill(w->proc.pid, SIGKILL);
+	}
+
+	if (w->retiring)
+	{
+		close(w->fd);
+		w->fd = -1;
+
+		/* already reaped, replace it */
+		if (!w->proc.pid)
+			uh_lua_worker_respawn(w);
+	}
+}
+
+static void uh_lua_worker_timeout_cb(struct uloop_timeout *t)
+{
+	struct uh_lua_state *state = container_of(t, struct uh_lua_state, timeout);
+
+	D("Lua: Worker(%d) timed out\n", state->worker->proc.pid);
+
+	if (state->worker->proc.pid)
+		kill(state->worker->proc.pid, SIGKILL);
+}
+
+static bool uh_lua_worker_socket_cb(struct client *cl)
+{
+	int len;
+	bool clean = false;
+	char buf[UH_LUA_FRAME_MAX];
+
+	struct uh_lua_state *state = (struct uh_lua_state *)cl->priv;
+	struct uh_lua_worker *w = state->worker;
+
+	/* there is unread post data waiting */
+	while (state->content_length > 0)
+	{
+		/* remaining data in http head buffer ... */
+		if (cl->httpbuf.len > 0)
+		{
+			len = min(state->content_length, cl->httpbuf.len);
+
+			D("Lua: Worker(%d) feed %d HTTP buffer bytes\n",
+			  w->proc.pid, len);
 
-			state->cl->httpbuf.len -= len;
-			state->cl->httpbuf.ptr += len;
+			memcpy(&buf[1], cl->httpbuf.ptr, len);
+
+			cl->httpbuf.len -= len;
+			cl->httpbuf.ptr += len;
 		}
 
 		/* read it from socket ... */
 		else
 		{
-			len = uh_tcp_recv(state->cl, buf,
-							  min(state->content_length, sizeof(buf)));
+			len = uh_tcp_recv(cl, &buf[1],
+							  min(state->content_length, UH_LIMIT_MSGHEAD));
 
 			if ((len < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
 				break;
 
-			D("Lua: Child(%d) feed %d/%d TCP socket bytes\n",
-			  state->cl->proc.pid, len,
-			  min(state->content_length, sizeof(buf)));
+			D("Lua: Worker(%d) feed %d/%d TCP socket bytes\n",
+			  w->proc.pid, len,
+			  min(state->content_length, UH_LIMIT_MSGHEAD));
 		}
 
-		if (len)
+		if (len > 0)
+		{
 			state->content_length -= len;
+
+			/* ... write to Lua worker */
+			buf[0] = UH_LUA_FRAME_BODY;
+			ensure_out(uh_raw_send(w->fd, buf, len + 1,
+								   cl->conf->script_timeout));
+		}
 		else
+		{
 			state->content_length = 0;
+		}
 
-		/* ... write to Lua process */
-		len = uh_raw_send(state->wfd, buf, len,
-						  cl->server->conf->script_timeout);
-
-		/* explicit EOF notification for the child */
+		/* explicit EOF notification for the worker */
 		if (state->content_length <= 0)
-			close(state->wfd);
+		{
+			buf[0] = UH_LUA_FRAME_EOF;
+			ensure_out(uh_raw_send(w->fd, buf, 1,
+								   cl->conf->script_timeout));
+		}
 	}
 
-	/* try to read data from child */
-	while ((len = uh_raw_recv(state->rfd, buf, sizeof(buf), -1)) > 0)
+	/* try to read frames from worker */
+	while ((len = recv(w->fd, buf, sizeof(buf), 0)) > 0)
 	{
+		if (buf[0] == UH_LUA_FRAME_END)
+		{
+			D("Lua: Worker(%d) finished request\n", w->proc.pid);
+
+			w->retiring = (len > 1) && buf[1];
+			clean = true;
+			goto out;
+		}
+
 		/* pass through buffer to socket */
-		D("Lua: Child(%d) relaying %d normal bytes\n", state->cl->proc.pid, len);
-		ensure_out(uh_tcp_send(state->cl, buf, len));
+		D("Lua: Worker(%d) relaying %d normal bytes\n", w->proc.pid, len - 1);
+		ensure_out(uh_tcp_send(cl, &buf[1], len - 1));
 		state->data_sent = true;
 	}
 
-	/* got EOF or read error from child */
+	/* got EOF or read error from worker */
 	if ((len == 0) ||
 		((errno != EAGAIN) && (errno != EWOULDBLOCK) && (len == -1)))
 	{
-		D("Lua: Child(%d) presumed dead [%s]\n",
-		  state->cl->proc.pid, strerror(errno));
+		D("Lua: Worker(%d) presumed dead [%s]\n",
+		  w->proc.pid, strerror(errno));
 
 		goto out;
 	}
 
+	/* worker is idle, do not hold back buffered output */
+	ensure_out(uh_tcp_flush(cl));
+
 	return true;
 
 out:
 	if (!state->data_sent)
 	{
-		if (state->cl->timeout.pending)
-			uh_http_sendhf(state->cl, 502, "Bad Gateway",
+		if (state->timeout.pending)
+			uh_http_sendhf(cl, 502, "Bad Gateway",
 						   "The Lua process did not produce any response\n");
 		else
-			uh_http_sendhf(state->cl, 504, "Gateway Timeout",
+			uh_http_sendhf(cl, 504, "Gateway Timeout",
 						   "The Lua process took too long to produce a "
 						   "response\n");
 	}
 
-	uh_lua_shutdown(state);
+	uloop_timeout_cancel(&state->timeout);
+	uh_lua_worker_put(w, clean);
+	free(state);
+
 	return false;
 }
 
-bool uh_lua_request(struct client *cl, lua_State *L)
+static bool uh_lua_worker_request(struct client *cl, struct uh_lua_worker *w)
 {
-	int i;
-	char *query_string;
-	const char *prefix = cl->server->conf->lua_prefix;
-	const char *err_str = NULL;
-
-	int rfd[2] = { 0, 0 };
-	int wfd[2] = { 0, 0 };
-
-	pid_t child;
+	int i, len;
+	char buf[UH_LUA_FRAME_MAX];
 
 	struct uh_lua_state *state;
+	struct uh_lua_wire_req *wire = (struct uh_lua_wire_req *)&buf[1];
 	struct http_request *req = &cl->request;
 
-	int content_length = cl->httpbuf.len;
-
-
 	/* allocate state */
 	if (!(state = malloc(sizeof(*state))))
 	{
@@ -370,180 +1569,361 @@ bool uh_lua_request(struct client *cl, lua_State *L)
 		return false;
 	}
 
-	/* spawn pipes for me->child, child->me */
-	if ((pipe(rfd) < 0) || (pipe(wfd) < 0))
+	memset(state, 0, sizeof(*state));
+	memset(buf, 0, sizeof(*wire) + 1);
+
+	state->cl = cl;
+	state->worker = w;
+	state->content_length = cl->httpbuf.len;
+
+	/* find content length */
+	if (req->method == UH_HTTP_MSG_POST)
 	{
-		if (rfd[0] > 0) close(rfd[0]);
-		if (rfd[1] > 0) close(rfd[1]);
-		if (wfd[0] > 0) close(wfd[0]);
-		if (wfd[1] > 0) close(wfd[1]);
+		foreach_header(i, req->headers)
+		{
+			if (!strcasecmp(req->headers[i], "Content-Length"))
+			{
+				state->content_length = atoi(req->headers[i+1]);
+				break;
+			}
+		}
+	}
 
-		uh_client_error(cl, 500, "Internal Server Error",
-						"Failed to create pipe: %s", strerror(errno));
+	/* pack request head */
+	buf[0] = UH_LUA_FRAME_REQ;
 
-		return false;
+	wire->method = req->method;
+	wire->version = req->version;
+	wire->content_length = cl->httpbuf.len;
+	wire->body_length = state->content_length;
+
+	memcpy(&wire->peeraddr, &cl->peeraddr, sizeof(wire->peeraddr));
+	memcpy(&wire->servaddr, uh_client_servaddr(cl), sizeof(wire->servaddr));
+
+	len = sizeof(*wire) + 1;
+	len += snprintf(&buf[len], sizeof(buf) - len, "%s", req->url) + 1;
+	wire->n_strings = 1;
+
+	foreach_header(i, req->headers)
+	{
+		if (len >= sizeof(buf))
+			break;
+
+		len += snprintf(&buf[len], sizeof(buf) - len, "%s",
+						req->headers[i]) + 1;
+
+		if (len >= sizeof(buf))
+			break;
+
+		len += snprintf(&buf[len], sizeof(buf) - len, "%s",
+						req->headers[i+1]) + 1;
+
+		wire->n_strings += 2;
 	}
 
+	w->busy = true;
 
-	switch ((child = fork()))
+	if (uh_raw_send(w->fd, buf, min(len, sizeof(buf)),
+					cl->conf->script_timeout) < 0)
 	{
-	case -1:
-		uh_client_error(cl, 500, "Internal Server Error",
-						"Failed to fork child: %s", strerror(errno));
+		uh_lua_worker_put(w, false);
+		free(state);
+
+		uh_client_error(cl, 502, "Bad Gateway",
+						"Failed to pass request to Lua worker: %s\n",
+						strerror(errno));
 
 		return false;
+	}
 
-	case 0:
-#ifdef DEBUG
-		sleep(atoi(getenv("UHTTPD_SLEEP_ON_FORK") ?: "0"));
-#endif
+	D("Lua: Worker(%d) got Client(%d)\n", w->proc.pid, cl->fd.fd);
 
-		/* close loose pipe ends */
-		close(rfd[0]);
-		close(wfd[1]);
+	state->timeout.cb = uh_lua_worker_timeout_cb;
+	uloop_timeout_set(&state->timeout, cl->conf->script_timeout * 1000);
 
-		/* patch stdout and stdin to pipes */
-		dup2(rfd[1], 1);
-		dup2(wfd[0], 0);
+	cl->cb = uh_lua_worker_socket_cb;
+	cl->priv = state;
 
-		/* avoid leaking our pipe into child-child processes */
-		fd_cloexec(rfd[1]);
-		fd_cloexec(wfd[0]);
+	return true;
+}
 
-		/* put handler callback on stack */
-		lua_getglobal(L, UH_LUA_CALLBACK);
+static void uh_lua_co_hook(lua_State *L, lua_Debug *ar)
+{
+	struct timespec now;
 
-		/* build env table */
-		lua_newtable(L);
+	if (!uh_lua_co_current)
+		return;
 
-		/* request method */
-		switch(req->method)
-		{
-			case UH_HTTP_MSG_GET:
-				lua_pushstring(L, "GET");
-				break;
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-			case UH_HTTP_MSG_HEAD:
-				lua_pushstring(L, "HEAD");
-				break;
+	if (now.tv_sec >= uh_lua_co_current->deadline)
+		luaL_error(L, "Script timeout");
+}
 
-			case UH_HTTP_MSG_POST:
-				lua_pushstring(L, "POST");
-				break;
-		}
+static void uh_lua_co_free(struct uh_lua_co *co)
+{
+	uloop_timeout_cancel(&co->timeout);
+	luaL_unref(uh_lua_pool.L, LUA_REGISTRYINDEX, co->ref);
+
+	free(co->out.data);
+	free(co);
+}
+
+static void uh_lua_co_resume(struct uh_lua_co *co, int nargs)
+{
+	int rv;
 
-		lua_setfield(L, -2, "REQUEST_METHOD");
+	co->wait = UH_LUA_CO_RUN;
+	uh_lua_co_current = co;
 
-		/* request url */
-		lua_pushstring(L, req->url);
-		lua_setfield(L, -2, "REQUEST_URI");
+	rv = lua_resume(co->L, nargs);
 
-		/* script name */
-		lua_pushstring(L, cl->server->conf->lua_prefix);
-		lua_setfield(L, -2, "SCRIPT_NAME");
+	/* suspended in send() or recv(), or by coroutine.yield() */
+	if (rv == LUA_YIELD)
+	{
+		uh_lua_co_current = NULL;
+		return;
+	}
 
-		/* query string, path info */
-		if ((query_string = strchr(req->url, '?')) != NULL)
-		{
-			lua_pushstring(L, query_string + 1);
-			lua_setfield(L, -2, "QUERY_STRING");
+	if (rv)
+	{
+		D("Lua: Client(%d) handler failed: %s\n",
+		  co->cl->fd.fd, lua_tostring(co->L, -1));
 
-			if ((int)(query_string - req->url) > strlen(prefix))
-			{
-				lua_pushlstring(L,
-					&req->url[strlen(prefix)],
-					(int)(query_string - req->url) - strlen(prefix)
-				);
+		uh_lua_error(&co->resp, lua_tostring(co->L, -1));
+	}
+	else
+	{
+		uh_lua_resp_flush(&co->resp, true);
+	}
 
-				lua_setfield(L, -2, "PATH_INFO");
-			}
-		}
-		else if (strlen(req->url) > strlen(prefix))
+	uh_lua_co_current = NULL;
+	co->done = true;
+}
+
+static void uh_lua_co_timeout_cb(struct uloop_timeout *t)
+{
+	struct uh_lua_co *co = container_of(t, struct uh_lua_co, timeout);
+	struct client *cl = co->cl;
+
+	D("Lua: Client(%d) handler timed out\n", cl->fd.fd);
+
+	if (!co->data_sent)
+		uh_http_sendhf(cl, 504, "Gateway Timeout",
+					   "The Lua process took too long to produce a "
+					   "response\n");
+
+	uh_lua_co_free(co);
+	uh_client_shutdown(cl);
+}
+
+/* a handler waiting for request data only needs to hear about input,
+ * anything else is resumed once the socket is writable */
+static void uh_lua_co_poll(struct uh_lua_co *co)
+{
+	unsigned int events = ULOOP_READ | ULOOP_WRITE;
+	struct uloop_fd *fd = &co->cl->fd;
+
+	if ((co->wait == UH_LUA_CO_RECV) && !uh_lua_co_flush(co))
+		events = ULOOP_READ;
+
+	if (!fd->registered || (fd->flags != events))
+		uloop_fd_add(fd, events);
+}
+
+static bool uh_lua_co_socket_cb(struct client *cl)
+{
+	int rlen;
+	char buf[UH_LIMIT_MSGHEAD];
+
+	struct uh_lua_co *co = (struct uh_lua_co *)cl->priv;
+
+	/* push out buffered response data */
+	if (uh_lua_co_flush(co) < 0)
+		goto out;
+
+	if (!co->done)
+	{
+		switch (co->wait)
 		{
-			lua_pushstring(L, &req->url[strlen(prefix)]);
-			lua_setfield(L, -2, "PATH_INFO");
+		case UH_LUA_CO_RECV:
+			rlen = uh_lua_co_recv(co, buf, co->wait_len);
+
+			if ((rlen < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+				break;
+
+			uh_lua_co_resume(co, uh_lua_recv_result(co->L, buf, rlen));
+			break;
+
+		case UH_LUA_CO_SEND:
+			if ((co->out.len - co->out.off) > UH_LUA_CO_OUTBUF)
+				break;
+
+			lua_pushnumber(co->L, co->wait_len);
+			uh_lua_co_resume(co, 1);
+			break;
+
+		default:
+			uh_lua_co_resume(co, 0);
+			break;
 		}
+	}
 
-		/* http protcol version */
-		lua_pushnumber(L, floor(req->version * 10) / 10);
-		lua_setfield(L, -2, "HTTP_VERSION");
+	if (co->done && (co->out.len == co->out.off))
+		goto out;
 
-		if (req->version > 1.0)
-			lua_pushstring(L, "HTTP/1.1");
-		else
-			lua_pushstring(L, "HTTP/1.0");
+	uh_lua_co_poll(co);
+	return true;
 
-		lua_setfield(L, -2, "SERVER_PROTOCOL");
+out:
+	uh_lua_co_free(co);
+	return false;
+}
 
+/* In-process mode runs each request as coroutine of the shared handler
+ * state, so globals are shared between concurrent requests. recv() and a
+ * send() exceeding the output buffer suspend the request, this fails with
+ * "attempt to yield across metamethod/C-call boundary" if they are called
+ * from within pcall(). Calls from coroutines created by the handler itself
+ * block instead. */
+static bool uh_lua_co_request(struct client *cl, lua_State *L)
+{
+	int i;
+	struct timespec now;
 
-		/* address information */
-		lua_pushstring(L, sa_straddr(&cl->peeraddr));
-		lua_setfield(L, -2, "REMOTE_ADDR");
+	struct uh_lua_co *co;
+	struct http_request *req = &cl->request;
+	const struct config *conf = cl->conf;
 
-		lua_pushinteger(L, sa_port(&cl->peeraddr));
-		lua_setfield(L, -2, "REMOTE_PORT");
+	/* allocate state */
+	if (!(co = calloc(1, sizeof(*co))))
+	{
+		uh_client_error(cl, 500, "Internal Server Error", "Out of memory");
+		return false;
+	}
 
-		lua_pushstring(L, sa_straddr(&cl->servaddr));
-		lua_setfield(L, -2, "SERVER_ADDR");
+	co->cl = cl;
+	co->content_length = cl->httpbuf.len;
 
-		lua_pushinteger(L, sa_port(&cl->servaddr));
-		lua_setfield(L, -2, "SERVER_PORT");
+	uh_lua_resp_init(&co->resp, req->version);
 
-		/* essential env vars */
+	/* find content length */
+	if (req->method == UH_HTTP_MSG_POST)
+	{
 		foreach_header(i, req->headers)
 		{
 			if (!strcasecmp(req->headers[i], "Content-Length"))
 			{
-				content_length = atoi(req->headers[i+1]);
-			}
-			else if (!strcasecmp(req->headers[i], "Content-Type"))
-			{
-				lua_pushstring(L, req->headers[i+1]);
-				lua_setfield(L, -2, "CONTENT_TYPE");
+				co->content_length = atoi(req->headers[i+1]);
+				break;
 			}
 		}
+	}
 
-		lua_pushnumber(L, content_length);
-		lua_setfield(L, -2, "CONTENT_LENGTH");
+	/* collect garbage of earlier requests before it counts against the
+	 * heap limit of this one */
+	if (uh_lua_mem.limit && (uh_lua_mem.used > (uh_lua_mem.limit / 2)))
+		lua_gc(L, LUA_GCCOLLECT, 0);
 
-		/* misc. headers */
-		lua_newtable(L);
+	/* anchor a new coroutine in the registry for the request lifetime */
+	co->L = lua_newthread(L);
+	co->ref = luaL_ref(L, LUA_REGISTRYINDEX);
 
-		foreach_header(i, req->headers)
-		{
-			if( strcasecmp(req->headers[i], "Content-Length") &&
-				strcasecmp(req->headers[i], "Content-Type"))
-			{
-				lua_pushstring(L, req->headers[i+1]);
-				lua_setfield(L, -2, req->headers[i]);
-			}
-		}
+	/* enforce the script timeout on handlers which never give up the cpu */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	co->deadline = now.tv_sec + conf->script_timeout;
+	lua_sethook(co->L, uh_lua_co_hook, LUA_MASKCOUNT, UH_LUA_CO_HOOK_COUNT);
 
-		lua_setfield(L, -2, "headers");
+	/* ... and on those suspended for too long */
+	co->timeout.cb = uh_lua_co_timeout_cb;
+	uloop_timeout_set(&co->timeout, conf->script_timeout * 1000);
 
+	D("Lua: Client(%d) running in-process handler\n", cl->fd.fd);
 
-		/* call */
-		switch (lua_pcall(L, 1, 0, 0))
-		{
-			case LUA_ERRMEM:
-			case LUA_ERRRUN:
-				err_str = luaL_checkstring(L, -1);
+	fd_nonblock(cl->fd.fd);
 
-				if (! err_str)
-					err_str = "Unknown error";
+	cl->cb = uh_lua_co_socket_cb;
+	cl->priv = co;
 
-				printf("HTTP/%.1f 500 Internal Server Error\r\n"
-					   "Connection: close\r\n"
-					   "Content-Type: text/plain\r\n"
-					   "Content-Length: %i\r\n\r\n"
-					   "Lua raised a runtime error:\n  %s\n",
-					   req->version, 31 + strlen(err_str), err_str);
+	lua_getglobal(co->L, UH_LUA_CALLBACK);
+	uh_lua_push_env(co->L, conf, req, &cl->peeraddr, uh_client_servaddr(cl),
+					cl->httpbuf.len);
 
-				break;
+	uh_lua_co_resume(co, 1);
+	uh_lua_co_poll(co);
 
-			default:
-				break;
-		}
+	return true;
+}
+
+bool uh_lua_request(struct client *cl, lua_State *L)
+{
+	int rfd[2] = { 0, 0 };
+	int wfd[2] = { 0, 0 };
+	int i;
+
+	pid_t child;
+
+	struct uh_lua_state *state;
+	struct uh_lua_worker *w;
+	struct http_request *req = &cl->request;
+
+	/* run as coroutine within the server process */
+	if (cl->conf->lua_inproc)
+		return uh_lua_co_request(cl, L);
+
+	/* hand off to an idle pre-forked worker if there is one */
+	if ((w = uh_lua_worker_get()) != NULL)
+		return uh_lua_worker_request(cl, w);
+
+	/* allocate state */
+	if (!(state = malloc(sizeof(*state))))
+	{
+		uh_client_error(cl, 500, "Internal Server Error", "Out of memory");
+		return false;
+	}
+
+	/* spawn pipes for me->child, child->me */
+	if ((pipe(rfd) < 0) || (pipe(wfd) < 0))
+	{
+		if (rfd[0] > 0) close(rfd[0]);
+		if (rfd[1] > 0) close(rfd[1]);
+		if (wfd[0] > 0) close(wfd[0]);
+		if (wfd[1] > 0) close(wfd[1]);
+
+		uh_client_error(cl, 500, "Internal Server Error",
+						"Failed to create pipe: %s", strerror(errno));
+
+		return false;
+	}
+
+
+	switch ((child = fork()))
+	{
+	case -1:
+		uh_client_error(cl, 500, "Internal Server Error",
+						"Failed to fork child: %s", strerror(errno));
+
+		return false;
+
+	case 0:
+#ifdef DEBUG
+		sleep(atoi(getenv("UHTTPD_SLEEP_ON_FORK") ?: "0"));
+#endif
+
+		/* close loose pipe ends */
+		close(rfd[0]);
+		close(wfd[1]);
+
+		/* patch stdout and stdin to pipes */
+		dup2(rfd[1], 1);
+		dup2(wfd[0], 0);
+
+		/* avoid leaking our pipe into child-child processes */
+		fd_cloexec(rfd[1]);
+		fd_cloexec(wfd[0]);
+
+		uh_lua_call(L, cl->conf, req,
+					&cl->peeraddr, uh_client_servaddr(cl), cl->httpbuf.len);
 
 		close(wfd[0]);
 		close(rfd[1]);
@@ -596,6 +1976,18 @@ bool uh_lua_request(struct client *cl, lua_State *L)
 
 void uh_lua_close(lua_State *L)
 {
+	int i;
+
+	/* terminate pre-forked workers */
+	for (i = 0; uh_lua_pool.workers && (i < uh_lua_pool.conf->lua_workers); i++)
+	{
+		if (uh_lua_pool.workers[i].proc.pid)
+		{
+			uloop_process_delete(&uh_lua_pool.workers[i].proc);
+			kill(uh_lua_pool.workers[i].proc.pid, SIGTERM);
+		}
+	}
+
 	lua_close(L);
 }
 #endif
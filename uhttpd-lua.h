@@ -20,6 +20,10 @@
 
 #include <math.h>  /* floor() */
 #include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -31,6 +35,80 @@
 #define UH_LUA_ERR_TOOBIG  -2
 #define UH_LUA_ERR_PARAM   -3
 
+/* precompiled handler and module bytecode, keyed on source mtime and size */
+#ifndef UH_LUA_CACHE_DIR
+#define UH_LUA_CACHE_DIR	"/tmp/uhttpd-lua"
+#endif
+#define UH_LUA_CACHE_MAGIC	"UHLC"
+
+/* response buffer, a flush emits status line, headers, chunk framing and
+ * up to UH_LUA_OUTBUF bytes of body with a single write */
+#define UH_LUA_OUTBUF		16384
+#define UH_LUA_RESP_HEAD	(UH_LIMIT_MSGHEAD + 128)
+#define UH_LUA_FLUSH_MAX	(UH_LUA_RESP_HEAD + UH_LUA_OUTBUF + 16)
+
+#define UH_LUA_CO_HOOK_COUNT	10000
+#define UH_LUA_CO_OUTBUF		65536
+
+#define UH_LUA_CO_RUN		0
+#define UH_LUA_CO_RECV		1
+#define UH_LUA_CO_SEND		2
+
+#define UH_LUA_WORKER_REQUESTS	500
+#define UH_LUA_WORKER_MEMORY	8192
+
+/* least time between two spawns of a worker slot in ms, so that a
+ * crashing handler or failing fork() does not spin */
+#define UH_LUA_WORKER_BACKOFF	1000
+
+/* worker socket frame types, first byte of every SOCK_SEQPACKET message */
+#define UH_LUA_FRAME_REQ	'R'		/* server -> worker: request head */
+#define UH_LUA_FRAME_BODY	'B'		/* server -> worker: request body data */
+#define UH_LUA_FRAME_EOF	'E'		/* server -> worker: end of request body */
+#define UH_LUA_FRAME_DATA	'D'		/* worker -> server: response data */
+#define UH_LUA_FRAME_END	'F'		/* worker -> server: response finished */
+
+#define UH_LUA_FRAME_MAX	(UH_LUA_FLUSH_MAX + 1)
+
+
+struct uh_lua_wire_req {
+	int method;
+	float version;
+	int content_length;
+	int body_length;
+	int n_strings;
+	struct sockaddr_in6 peeraddr;
+	struct sockaddr_in6 servaddr;
+};
+
+struct uh_lua_cache_hdr {
+	char magic[4];
+	time_t mtime;
+	off_t size;
+};
+
+struct uh_lua_resp {
+	float version;
+	bool managed;
+	bool flushed;
+	bool head_sent;
+	bool has_length;
+	bool chunked;
+	char status[64];
+	char head[UH_LIMIT_MSGHEAD];
+	int hlen;
+	int len;
+	char buf[UH_LUA_FLUSH_MAX];
+};
+
+struct uh_lua_worker {
+	struct uloop_process proc;
+	int fd;
+	int requests;
+	bool busy;
+	bool retiring;
+	unsigned long long spawned;
+};
 
 struct uh_lua_state {
 	int rfd;
@@ -39,6 +117,34 @@ struct uh_lua_state {
 	char httpbuf[UH_LIMIT_MSGHEAD];
 	int content_length;
 	bool data_sent;
+	struct uh_lua_worker *worker;
+	struct uloop_timeout timeout;
+};
+
+struct uh_lua_co {
+	lua_State *L;
+	int ref;
+	int wait;
+	int wait_len;
+	int content_length;
+	bool data_sent;
+	bool failed;
+	bool done;
+	struct client *cl;
+	time_t deadline;
+	struct uloop_timeout timeout;
+	struct uh_lua_resp resp;
+	struct {
+		char *data;
+		int len;
+		int off;
+		int size;
+	} out;
+};
+
+struct uh_lua_mem {
+	size_t used;
+	size_t limit;
 };
 
 lua_State * uh_lua_init(const struct config *conf);
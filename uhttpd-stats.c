@@ -0,0 +1,473 @@
+/*
+ * uhttpd - Tiny single-threaded httpd - Request statistics
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "uhttpd.h"
+#include "uhttpd-utils.h"
+#include "uhttpd-stats.h"
+#include "uhttpd-log.h"
+
+
+static const char *uh_stats_handlers[UH_STATS_HANDLERS] = {
+	[UH_STATS_OTHER] = "other",
+	[UH_STATS_FILE]  = "file",
+	[UH_STATS_CGI]   = "cgi",
+	[UH_STATS_LUA]   = "lua",
+	[UH_STATS_UBUS]  = "ubus",
+};
+
+static const struct {
+	const char *name;
+	int from;
+	int to;
+} uh_stats_intervals[UH_STATS_INTERVALS] = {
+	{ "headers",    UH_STATS_ACCEPT,  UH_STATS_HEADERS    },
+	{ "dispatch",   UH_STATS_HEADERS, UH_STATS_DISPATCH   },
+	{ "first_byte", UH_STATS_ACCEPT,  UH_STATS_FIRST_BYTE },
+	{ "total",      UH_STATS_ACCEPT,  UH_STATS_DONE       },
+};
+
+/* Prometheus bucket bounds in microseconds */
+static const unsigned long uh_stats_bounds[] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+	100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+struct uh_stats_buf {
+	char *data;
+	int len;
+	int size;
+};
+
+
+struct uh_stats * uh_stats_init(void)
+{
+	struct uh_stats *stats;
+
+	if ((stats = calloc(1, sizeof(*stats))) != NULL)
+		stats->started = time(NULL);
+
+	return stats;
+}
+
+
+static int uh_stats_bucket(unsigned long long us)
+{
+	int msb = 0;
+	unsigned long v = (us > 0xFFFFFFFFULL) ? 0xFFFFFFFFUL : us;
+
+	if (v < UH_STATS_SUB_COUNT)
+		return v;
+
+	while (v >> (msb + 1))
+		msb++;
+
+	return (msb - UH_STATS_SUB_BITS + 1) * UH_STATS_SUB_COUNT +
+		((v >> (msb - UH_STATS_SUB_BITS)) & (UH_STATS_SUB_COUNT - 1));
+}
+
+/* largest value that still falls into the given bucket */
+static unsigned long uh_stats_bucket_max(int idx)
+{
+	int shift;
+
+	if (idx < UH_STATS_SUB_COUNT)
+		return idx;
+
+	shift = idx / UH_STATS_SUB_COUNT - 1;
+
+	return (((unsigned long)UH_STATS_SUB_COUNT + idx % UH_STATS_SUB_COUNT)
+			<< shift) + (1UL << shift) - 1;
+}
+
+static void uh_stats_histogram_add(struct uh_histogram *h,
+								   unsigned long long us)
+{
+	h->count++;
+	h->sum += us;
+	h->max = max(h->max, us);
+	h->buckets[uh_stats_bucket(us)]++;
+}
+
+static unsigned long uh_stats_percentile(struct uh_histogram *h, int permille)
+{
+	int i;
+	unsigned long long seen = 0;
+	unsigned long long rank = (h->count * permille + 999) / 1000;
+
+	if (!rank)
+		rank = 1;
+
+	for (i = 0; i < UH_STATS_BUCKETS; i++)
+	{
+		seen += h->buckets[i];
+
+		if (seen >= rank)
+			return min(uh_stats_bucket_max(i), h->max);
+	}
+
+	return h->max;
+}
+
+
+void uh_stats_record_sent(struct client *cl, const char *buf, int len)
+{
+	struct uh_request_stats *rs = &cl->stats;
+
+	rs->bytes += len;
+
+	/* take the code off the status line, 1xx ones are provisional and
+	 * do not count as first byte of the response */
+	if (buf && (rs->status < 200) && (len > 12) && !strncmp(buf, "HTTP/", 5) &&
+		isdigit(buf[9]) && isdigit(buf[10]) && isdigit(buf[11]))
+	{
+		rs->status = (buf[9] - '0') * 100 + (buf[10] - '0') * 10 +
+			(buf[11] - '0');
+
+		if (rs->status < 200)
+			return;
+	}
+
+	if (!rs->ts[UH_STATS_FIRST_BYTE])
+		rs->ts[UH_STATS_FIRST_BYTE] = uh_stats_now();
+}
+
+void uh_stats_record_done(struct client *cl)
+{
+	int i;
+	struct uh_stats *stats = cl->conf->stats;
+	struct uh_request_stats *rs = &cl->stats;
+	unsigned long long *ts = rs->ts;
+
+	/* connection closed before a request was read */
+	if (!ts[UH_STATS_HEADERS])
+		return;
+
+	ts[UH_STATS_DONE] = uh_stats_now();
+
+	stats->requests[rs->handler]++;
+	stats->bytes[rs->handler] += rs->bytes;
+	stats->status[(rs->status >= 100 && rs->status < 600) ? rs->status / 100 : 0]++;
+
+	for (i = 0; i < UH_STATS_INTERVALS; i++)
+	{
+		if (!ts[uh_stats_intervals[i].from] || !ts[uh_stats_intervals[i].to])
+			continue;
+
+		uh_stats_histogram_add(&stats->latency[rs->handler][i],
+							   ts[uh_stats_intervals[i].to] -
+							   ts[uh_stats_intervals[i].from]);
+	}
+}
+
+
+static void uh_stats_printf(struct uh_stats_buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	char *tmp;
+	int len;
+
+	while (b->len >= 0)
+	{
+		va_start(ap, fmt);
+		len = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+
+		if (len < 0)
+		{
+			b->len = -1;
+			break;
+		}
+
+		if (len < b->size - b->len)
+		{
+			b->len += len;
+			break;
+		}
+
+		if (!(tmp = realloc(b->data, b->size + max(len + 1, 4096))))
+		{
+			b->len = -1;
+			break;
+		}
+
+		b->data = tmp;
+		b->size += max(len + 1, 4096);
+	}
+}
+
+static void uh_stats_clients(int *clients, int *children)
+{
+	struct client *cl;
+
+	*clients = *children = 0;
+
+	for (cl = uh_client_first(); cl; cl = cl->next)
+	{
+		(*clients)++;
+
+		if (cl->proc.pid && !cl->dead)
+			(*children)++;
+	}
+}
+
+static void uh_stats_text(struct uh_stats_buf *b, struct config *conf)
+{
+	int h, i, clients, children;
+	struct uh_stats *stats = conf->stats;
+	struct uh_histogram *hist;
+
+	uh_stats_clients(&clients, &children);
+
+	uh_stats_printf(b, "uptime: %ld\n", (long)(time(NULL) - stats->started));
+	uh_stats_printf(b, "clients: %d\n", clients);
+	uh_stats_printf(b, "children: %d\n", children);
+	uh_stats_printf(b, "deferred: %lu\n", conf->conn_stats->deferred);
+	uh_stats_printf(b, "shed: %lu\n", conf->conn_stats->shed);
+
+#ifdef HAVE_TLS
+	uh_stats_printf(b, "tls handshakes: %lu resumed: %lu failures: %lu "
+					"timeouts: %lu\n",
+					conf->tls_stats->handshakes, conf->tls_stats->resumed,
+					conf->tls_stats->failures, conf->tls_stats->timeouts);
+#endif
+
+	if (conf->log)
+		uh_stats_printf(b, "log records: %lu dropped: %lu\n",
+						conf->log->records, conf->log->dropped);
+
+	uh_stats_printf(b, "status 1xx: %lu 2xx: %lu 3xx: %lu 4xx: %lu "
+					"5xx: %lu other: %lu\n",
+					stats->status[1], stats->status[2], stats->status[3],
+					stats->status[4], stats->status[5], stats->status[0]);
+
+	uh_stats_printf(b, "\n%-6s %10s %14s\n", "", "requests", "bytes");
+
+	for (h = 0; h < UH_STATS_HANDLERS; h++)
+		uh_stats_printf(b, "%-6s %10lu %14llu\n", uh_stats_handlers[h],
+						stats->requests[h], stats->bytes[h]);
+
+	uh_stats_printf(b, "\n%-6s %-10s %8s %8s %8s %8s %8s %8s %8s\n",
+					"", "latency us", "count", "mean", "p50", "p90",
+					"p99", "p999", "max");
+
+	for (h = 0; h < UH_STATS_HANDLERS; h++)
+	{
+		for (i = 0; i < UH_STATS_INTERVALS; i++)
+		{
+			hist = &stats->latency[h][i];
+
+			if (!hist->count)
+				continue;
+
+			uh_stats_printf(b, "%-6s %-10s %8llu %8llu %8lu %8lu %8lu %8lu %8lu\n",
+							uh_stats_handlers[h], uh_stats_intervals[i].name,
+							hist->count, hist->sum / hist->count,
+							uh_stats_percentile(hist, 500),
+							uh_stats_percentile(hist, 900),
+							uh_stats_percentile(hist, 990),
+							uh_stats_percentile(hist, 999),
+							hist->max);
+		}
+	}
+}
+
+static void uh_stats_metric(struct uh_stats_buf *b, const char *name,
+							const char *type, const char *help)
+{
+	uh_stats_printf(b, "# HELP uhttpd_%s %s\n# TYPE uhttpd_%s %s\n",
+					name, help, name, type);
+}
+
+static void uh_stats_prometheus(struct uh_stats_buf *b, struct config *conf)
+{
+	int h, i, j, k, clients, children;
+	unsigned long long seen;
+	struct uh_stats *stats = conf->stats;
+	struct uh_histogram *hist;
+
+	uh_stats_clients(&clients, &children);
+
+	uh_stats_metric(b, "uptime_seconds", "gauge",
+					"Seconds since the server started.");
+	uh_stats_printf(b, "uhttpd_uptime_seconds %ld\n",
+					(long)(time(NULL) - stats->started));
+
+	uh_stats_metric(b, "clients", "gauge", "Open client connections.");
+	uh_stats_printf(b, "uhttpd_clients %d\n", clients);
+
+	uh_stats_metric(b, "children", "gauge",
+					"Request handler processes running.");
+	uh_stats_printf(b, "uhttpd_children %d\n", children);
+
+	uh_stats_metric(b, "connections_deferred_total", "counter",
+					"Times a listener was paused at capacity.");
+	uh_stats_printf(b, "uhttpd_connections_deferred_total %lu\n",
+					conf->conn_stats->deferred);
+
+	uh_stats_metric(b, "connections_shed_total", "counter",
+					"Connections answered with 503 at capacity.");
+	uh_stats_printf(b, "uhttpd_connections_shed_total %lu\n",
+					conf->conn_stats->shed);
+
+#ifdef HAVE_TLS
+	uh_stats_metric(b, "tls_handshakes_total", "counter",
+					"Completed TLS handshakes.");
+	uh_stats_printf(b, "uhttpd_tls_handshakes_total %lu\n",
+					conf->tls_stats->handshakes);
+
+	uh_stats_metric(b, "tls_resumed_total", "counter",
+					"TLS handshakes that resumed a session.");
+	uh_stats_printf(b, "uhttpd_tls_resumed_total %lu\n",
+					conf->tls_stats->resumed);
+
+	uh_stats_metric(b, "tls_failures_total", "counter",
+					"Failed TLS handshakes.");
+	uh_stats_printf(b, "uhttpd_tls_failures_total %lu\n",
+					conf->tls_stats->failures);
+
+	uh_stats_metric(b, "tls_timeouts_total", "counter",
+					"TLS handshakes that timed out.");
+	uh_stats_printf(b, "uhttpd_tls_timeouts_total %lu\n",
+					conf->tls_stats->timeouts);
+#endif
+
+	if (conf->log)
+	{
+		uh_stats_metric(b, "log_records_total", "counter",
+						"Access log records queued.");
+		uh_stats_printf(b, "uhttpd_log_records_total %lu\n",
+						conf->log->records);
+
+		uh_stats_metric(b, "log_dropped_total", "counter",
+						"Access log records dropped.");
+		uh_stats_printf(b, "uhttpd_log_dropped_total %lu\n",
+						conf->log->dropped);
+	}
+
+	uh_stats_metric(b, "responses_total", "counter",
+					"Responses by status class.");
+
+	for (i = 1; i < 6; i++)
+		uh_stats_printf(b, "uhttpd_responses_total{code=\"%dxx\"} %lu\n",
+						i, stats->status[i]);
+
+	uh_stats_printf(b, "uhttpd_responses_total{code=\"other\"} %lu\n",
+					stats->status[0]);
+
+	uh_stats_metric(b, "requests_total", "counter", "Requests by handler.");
+
+	for (h = 0; h < UH_STATS_HANDLERS; h++)
+		uh_stats_printf(b, "uhttpd_requests_total{handler=\"%s\"} %lu\n",
+						uh_stats_handlers[h], stats->requests[h]);
+
+	uh_stats_metric(b, "sent_bytes_total", "counter",
+					"Bytes sent by handler.");
+
+	for (h = 0; h < UH_STATS_HANDLERS; h++)
+		uh_stats_printf(b, "uhttpd_sent_bytes_total{handler=\"%s\"} %llu\n",
+						uh_stats_handlers[h], stats->bytes[h]);
+
+	uh_stats_metric(b, "request_phase_seconds", "histogram",
+					"Time spent in request phases by handler.");
+
+	for (h = 0; h < UH_STATS_HANDLERS; h++)
+	{
+		for (i = 0; i < UH_STATS_INTERVALS; i++)
+		{
+			hist = &stats->latency[h][i];
+
+			if (!hist->count)
+				continue;
+
+			/* a bucket straddling a bound is counted above it */
+			for (j = 0, k = 0, seen = 0; j < array_size(uh_stats_bounds); j++)
+			{
+				for (; (k < UH_STATS_BUCKETS) &&
+					 (uh_stats_bucket_max(k) <= uh_stats_bounds[j]); k++)
+					seen += hist->buckets[k];
+
+				uh_stats_printf(b, "uhttpd_request_phase_seconds_bucket"
+								"{handler=\"%s\",phase=\"%s\",le=\"%g\"} %llu\n",
+								uh_stats_handlers[h], uh_stats_intervals[i].name,
+								uh_stats_bounds[j] / 1e6, seen);
+			}
+
+			uh_stats_printf(b, "uhttpd_request_phase_seconds_bucket"
+							"{handler=\"%s\",phase=\"%s\",le=\"+Inf\"} %llu\n",
+							uh_stats_handlers[h], uh_stats_intervals[i].name,
+							hist->count);
+
+			uh_stats_printf(b, "uhttpd_request_phase_seconds_sum"
+							"{handler=\"%s\",phase=\"%s\"} %.6f\n",
+							uh_stats_handlers[h], uh_stats_intervals[i].name,
+							hist->sum / 1e6);
+
+			uh_stats_printf(b, "uhttpd_request_phase_seconds_count"
+							"{handler=\"%s\",phase=\"%s\"} %llu\n",
+							uh_stats_handlers[h], uh_stats_intervals[i].name,
+							hist->count);
+		}
+	}
+}
+
+
+bool uh_stats_match(struct client *cl, const char *url)
+{
+	int len;
+	const char *prefix = cl->conf->stats_url;
+
+	if (!prefix)
+		return false;
+
+	len = strlen(prefix);
+
+	return !strncmp(url, prefix, len) && (!url[len] || (url[len] == '?'));
+}
+
+bool uh_stats_request(struct client *cl, struct http_request *req)
+{
+	const char *query = strchr(req->url, '?');
+	struct uh_stats_buf b = { 0 };
+	bool prom;
+
+	prom = query && strstr(query, "format=prometheus");
+
+	if (prom)
+		uh_stats_prometheus(&b, cl->conf);
+	else
+		uh_stats_text(&b, cl->conf);
+
+	if (b.len < 0)
+	{
+		uh_http_response(cl, 500, "Internal Server Error");
+		goto out;
+	}
+
+	ensure_out(uh_http_sendf(cl, NULL,
+		"HTTP/%.1f 200 OK\r\n"
+		"Connection: close\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Content-Type: text/plain%s\r\n"
+		"Content-Length: %d\r\n\r\n",
+			req->version, prom ? "; version=0.0.4" : "", b.len));
+
+	if (req->method != UH_HTTP_MSG_HEAD)
+		ensure_out(uh_tcp_send(cl, b.data, b.len));
+
+out:
+	free(b.data);
+	return false;
+}
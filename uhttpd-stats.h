@@ -0,0 +1,90 @@
+/*
+ * uhttpd - Tiny single-threaded httpd - Request statistics header
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _UHTTPD_STATS_
+
+#include <time.h>
+
+/* log-linear latency buckets in microseconds: values below 8 are exact,
+ * above that each power of two is split into 8 steps (<= 12.5% error),
+ * up to 2^32us */
+#define UH_STATS_SUB_BITS	3
+#define UH_STATS_SUB_COUNT	(1 << UH_STATS_SUB_BITS)
+#define UH_STATS_BUCKETS	((32 - UH_STATS_SUB_BITS + 1) * UH_STATS_SUB_COUNT)
+
+/* accept to headers, headers to dispatch, accept to first byte and
+ * accept to done */
+#define UH_STATS_INTERVALS	4
+
+/* 64 bit counters, 32 bit ones wrap after a few million requests */
+struct uh_histogram {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long max;
+	unsigned long long buckets[UH_STATS_BUCKETS];
+};
+
+struct uh_stats {
+	time_t started;
+	unsigned long requests[UH_STATS_HANDLERS];
+	unsigned long long bytes[UH_STATS_HANDLERS];
+	unsigned long status[6];
+	struct uh_histogram latency[UH_STATS_HANDLERS][UH_STATS_INTERVALS];
+};
+
+struct uh_stats * uh_stats_init(void);
+
+void uh_stats_record_sent(struct client *cl, const char *buf, int len);
+void uh_stats_record_done(struct client *cl);
+
+bool uh_stats_match(struct client *cl, const char *url);
+bool uh_stats_request(struct client *cl, struct http_request *req);
+
+static inline unsigned long long uh_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* the hooks below are no more than a pointer test without -X or -a,
+ * the access log wants timestamps, status and size as well */
+static inline void uh_stats_mark(struct client *cl, int phase)
+{
+	if (cl->conf->stats || cl->conf->log)
+		cl->stats.ts[phase] = uh_stats_now();
+}
+
+static inline void uh_stats_dispatch(struct client *cl, int handler)
+{
+	cl->stats.handler = handler;
+	uh_stats_mark(cl, UH_STATS_DISPATCH);
+}
+
+static inline void uh_stats_sent(struct client *cl, const char *buf, int len)
+{
+	if ((cl->conf->stats || cl->conf->log) && (len > 0))
+		uh_stats_record_sent(cl, buf, len);
+}
+
+static inline void uh_stats_done(struct client *cl)
+{
+	if (cl->conf->stats)
+		uh_stats_record_done(cl);
+}
+
+#endif
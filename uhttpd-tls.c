@@ -38,6 +38,28 @@ SSL_CTX * uh_tls_ctx_init(void)
 #endif
 		SSL_CTX_set_verify(c, SSL_VERIFY_NONE, NULL);
 
+#ifdef TLS_IS_OPENSSL
+	/* let the server pick, so ECDSA capable clients get the ECDSA cert */
+	if (c)
+	{
+		SSL_CTX_set_options(c, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 |
+							   SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+		SSL_CTX_set_cipher_list(c, UH_TLS_CIPHERS);
+
+#if (OPENSSL_VERSION_NUMBER >= 0x10002000L) && \
+	(OPENSSL_VERSION_NUMBER < 0x10100000L)
+		SSL_CTX_set_ecdh_auto(c, 1);
+#endif
+	}
+#endif
+
+#if defined(TLS_IS_OPENSSL) && defined(SSL_OP_ENABLE_KTLS)
+	/* hand record encryption to the kernel where supported */
+	if (c)
+		SSL_CTX_set_options(c, SSL_OP_ENABLE_KTLS);
+#endif
+
 	return c;
 }
 
@@ -61,68 +83,345 @@ int uh_tls_ctx_key(SSL_CTX *c, const char *file)
 	return rv;
 }
 
+#ifdef TLS_IS_OPENSSL
+static struct uh_tls_ticket_key uh_tls_ticket_keys[UH_TLS_TICKET_KEYS];
+static int uh_tls_ticket_lifetime;
+
+static int uh_tls_ticket_rotate(void)
+{
+	time_t now = time(NULL);
+	struct uh_tls_ticket_key *k = uh_tls_ticket_keys;
+
+	if (k->created && ((now - k->created) < uh_tls_ticket_lifetime))
+		return 0;
+
+	memmove(&k[1], &k[0], sizeof(*k) * (UH_TLS_TICKET_KEYS - 1));
+
+	if ((RAND_bytes(k->name, sizeof(k->name)) < 1) ||
+		(RAND_bytes(k->aes, sizeof(k->aes)) < 1) ||
+		(RAND_bytes(k->hmac, sizeof(k->hmac)) < 1))
+	{
+		memset(k, 0, sizeof(*k));
+		return -1;
+	}
+
+	D("TLS: rotated session ticket key\n");
+
+	k->created = now;
+	return 0;
+}
+
+static struct uh_tls_ticket_key * uh_tls_ticket_find(const unsigned char *name)
+{
+	int i;
+
+	for (i = 0; i < UH_TLS_TICKET_KEYS; i++)
+		if (uh_tls_ticket_keys[i].created &&
+			!memcmp(uh_tls_ticket_keys[i].name, name, 16))
+			return &uh_tls_ticket_keys[i];
+
+	return NULL;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int uh_tls_ticket_cb(SSL *s, unsigned char *name, unsigned char *iv,
+							EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc)
+{
+	struct uh_tls_ticket_key *k = uh_tls_ticket_keys;
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+		OSSL_PARAM_construct_end()
+	};
+
+	if (uh_tls_ticket_rotate())
+		return -1;
+
+	if (enc)
+	{
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) < 1)
+			return -1;
+
+		memcpy(name, k->name, sizeof(k->name));
+
+		if (!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, k->aes, iv) ||
+			!EVP_MAC_init(hctx, k->hmac, sizeof(k->hmac), params))
+			return -1;
+
+		return 1;
+	}
+
+	if (!(k = uh_tls_ticket_find(name)))
+		return 0;
+
+	if (!EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, k->aes, iv) ||
+		!EVP_MAC_init(hctx, k->hmac, sizeof(k->hmac), params))
+		return -1;
+
+	/* reissue tickets of a retired key */
+	return (k == uh_tls_ticket_keys) ? 1 : 2;
+}
+#else
+static int uh_tls_ticket_cb(SSL *s, unsigned char *name, unsigned char *iv,
+							EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+{
+	struct uh_tls_ticket_key *k = uh_tls_ticket_keys;
+
+	if (uh_tls_ticket_rotate())
+		return -1;
+
+	if (enc)
+	{
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) < 1)
+			return -1;
+
+		memcpy(name, k->name, sizeof(k->name));
+
+		if (!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, k->aes, iv) ||
+			!HMAC_Init_ex(hctx, k->hmac, sizeof(k->hmac), EVP_sha256(), NULL))
+			return -1;
+
+		return 1;
+	}
+
+	if (!(k = uh_tls_ticket_find(name)))
+		return 0;
+
+	if (!EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, k->aes, iv) ||
+		!HMAC_Init_ex(hctx, k->hmac, sizeof(k->hmac), EVP_sha256(), NULL))
+		return -1;
+
+	/* reissue tickets of a retired key */
+	return (k == uh_tls_ticket_keys) ? 1 : 2;
+}
+#endif
+#endif
+
+#ifdef TLS_IS_OPENSSL
+static struct uh_tls_sni *uh_tls_sni_list = NULL;
+
+static struct uh_tls_sni * uh_tls_sni_find(const char *name)
+{
+	struct uh_tls_sni *sni;
+
+	for (sni = uh_tls_sni_list; sni; sni = sni->next)
+		if (!strcasecmp(sni->name, name))
+			return sni;
+
+	return NULL;
+}
+
+static int uh_tls_sni_cb(SSL *s, int *al, void *arg)
+{
+	char wild[256];
+	const char *dot;
+	struct uh_tls_sni *sni;
+	const char *name = SSL_get_servername(s, TLSEXT_NAMETYPE_host_name);
+
+	if (!name)
+		return SSL_TLSEXT_ERR_OK;
+
+	if (!(sni = uh_tls_sni_find(name)) && (dot = strchr(name, '.')) != NULL)
+	{
+		snprintf(wild, sizeof(wild), "*%s", dot);
+		sni = uh_tls_sni_find(wild);
+	}
+
+	D("TLS: servername %s = %p\n", name, sni ? sni->ctx : NULL);
+
+	/* unknown names get the default certificate */
+	if (sni)
+		SSL_set_SSL_CTX(s, sni->ctx);
+
+	return SSL_TLSEXT_ERR_OK;
+}
+
+int uh_tls_ctx_sni(SSL_CTX *c, const char *dir)
+{
+	DIR *d;
+	int n = 0;
+	char *tag;
+	char name[256];
+	char path[PATH_MAX];
+	struct dirent *e;
+	struct uh_tls_sni *sni;
+	size_t len;
+
+	if (!(d = opendir(dir)))
+		return -1;
+
+	while ((e = readdir(d)) != NULL)
+	{
+		len = strlen(e->d_name);
+
+		if ((len <= 4) || (len - 4 >= sizeof(name)) ||
+			strcmp(&e->d_name[len - 4], ".crt"))
+			continue;
+
+		memcpy(name, e->d_name, len - 4);
+		name[len - 4] = 0;
+
+		/* host@tag adds another certificate type for the same host */
+		if ((tag = strchr(name, '@')) != NULL)
+			*tag = 0;
+
+		if (!(sni = uh_tls_sni_find(name)))
+		{
+			if (!(sni = calloc(1, sizeof(*sni))) ||
+				!(sni->ctx = uh_tls_ctx_init()))
+			{
+				free(sni);
+				continue;
+			}
+
+			/* sessions must stay valid across the context switch */
+			SSL_CTX_set_session_id_context(sni->ctx,
+				(const unsigned char *)"uhttpd", 6);
+
+			strcpy(sni->name, name);
+			sni->next = uh_tls_sni_list;
+			uh_tls_sni_list = sni;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+
+		if (uh_tls_ctx_cert(sni->ctx, path) < 1)
+		{
+			fprintf(stderr, "Notice: Invalid certificate file %s\n", path);
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%.*s.key", dir,
+				 (int)(len - 4), e->d_name);
+
+		if (uh_tls_ctx_key(sni->ctx, path) < 1)
+		{
+			fprintf(stderr, "Notice: Invalid private key file %s\n", path);
+			continue;
+		}
+
+		D("TLS: loaded %s for %s\n", e->d_name, sni->name);
+		n++;
+	}
+
+	closedir(d);
+
+	if (n > 0)
+		SSL_CTX_set_tlsext_servername_callback(c, uh_tls_sni_cb);
+
+	return n;
+}
+#else
+int uh_tls_ctx_sni(SSL_CTX *c, const char *dir)
+{
+	return -1;
+}
+#endif
+
+int uh_tls_ctx_cache(SSL_CTX *c, int size, int lifetime)
+{
+	if (size <= 0)
+	{
+		SSL_CTX_set_session_cache_mode(c, SSL_SESS_CACHE_OFF);
+#ifdef TLS_IS_OPENSSL
+		SSL_CTX_set_options(c, SSL_OP_NO_TICKET);
+#endif
+		return 1;
+	}
+
+	SSL_CTX_set_session_cache_mode(c, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(c, size);
+	SSL_CTX_set_timeout(c, lifetime);
+	SSL_CTX_set_session_id_context(c, (const unsigned char *)"uhttpd", 6);
+
+#ifdef TLS_IS_OPENSSL
+	/* stateless resumption with our own rotating keys */
+	uh_tls_ticket_lifetime = lifetime;
+
+	if (uh_tls_ticket_rotate())
+		return 0;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	if (!SSL_CTX_set_tlsext_ticket_key_evp_cb(c, uh_tls_ticket_cb))
+		return 0;
+#else
+	if (!SSL_CTX_set_tlsext_ticket_key_cb(c, uh_tls_ticket_cb))
+		return 0;
+#endif
+#endif
+
+	return 1;
+}
+
 void uh_tls_ctx_free(struct listener *l)
 {
 	SSL_CTX_free(l->tls);
 }
 
 
+/* performs one handshake step, called again on socket readiness */
 int uh_tls_client_accept(struct client *c)
 {
 	int rv, err;
 	int fd = c->fd.fd;
+	struct uh_tls_wbuf *wb;
 
 	if (!c->server || !c->server->tls)
 	{
 		c->tls = NULL;
-		return 1;
+		return UH_TLS_DONE;
 	}
 
-	if ((c->tls = SSL_new(c->server->tls)))
+	if (!c->tls)
 	{
-		if ((rv = SSL_set_fd(c->tls, fd)) < 1)
-		{
-			SSL_free(c->tls);
-			c->tls = NULL;
-		}
-		else
-		{
-			while (true)
-			{
-				rv = SSL_accept(c->tls);
-				err = SSL_get_error(c->tls, rv);
-
-				if ((rv != 1) &&
-					(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE))
-				{
-					if (uh_socket_wait(fd, c->server->conf->network_timeout,
-									   (err == SSL_ERROR_WANT_WRITE)))
-					{
-						D("TLS: accept(%d) = retry\n", fd);
-						continue;
-					}
-
-					D("TLS: accept(%d) = timeout\n", fd);
-				}
-				else if (rv == 1)
-				{
-					D("TLS: accept(%d) = %p\n", fd, c->tls);
-					return 1;
-				}
+		if (!(c->tls = SSL_new(c->server->tls)))
+			return UH_TLS_FAILED;
+
+		if (SSL_set_fd(c->tls, fd) < 1)
+			goto fail;
+
+		/* aggregate small writes into full records */
+		if ((wb = calloc(1, sizeof(*wb))) != NULL)
+			SSL_set_app_data(c->tls, wb);
+
+		fd_nonblock(fd);
+	}
+
+	rv = SSL_accept(c->tls);
+
+	if (rv == 1)
+	{
+		D("TLS: accept(%d) = %p\n", fd, c->tls);
 
 #ifdef TLS_IS_OPENSSL
-				D("TLS: accept(%d) = failed: %s\n",
-				  fd, ERR_error_string(ERR_get_error(), NULL));
+		if (SSL_session_reused(c->tls))
+			c->conf->tls_stats->resumed++;
 #endif
 
-				SSL_free(c->tls);
-				c->tls = NULL;
-				break;
-			}
-		}
+		return UH_TLS_DONE;
 	}
 
-	return 0;
+	switch ((err = SSL_get_error(c->tls, rv)))
+	{
+	case SSL_ERROR_WANT_READ:
+		D("TLS: accept(%d) = want read\n", fd);
+		return UH_TLS_WANT_READ;
+
+	case SSL_ERROR_WANT_WRITE:
+		D("TLS: accept(%d) = want write\n", fd);
+		return UH_TLS_WANT_WRITE;
+	}
+
+fail:
+#ifdef TLS_IS_OPENSSL
+	D("TLS: accept(%d) = failed: %s\n",
+	  fd, ERR_error_string(ERR_get_error(), NULL));
+#endif
+
+	free(SSL_get_app_data(c->tls));
+	SSL_free(c->tls);
+	c->tls = NULL;
+
+	return UH_TLS_FAILED;
 }
 
 int uh_tls_client_recv(struct client *c, char *buf, int len)
@@ -141,12 +440,12 @@ int uh_tls_client_recv(struct client *c, char *buf, int len)
 	return rv;
 }
 
-int uh_tls_client_send(struct client *c, const char *buf, int len)
+static int uh_tls_write(struct client *c, const char *buf, int len)
 {
 	int rv = SSL_write(c->tls, buf, len);
-	int err = SSL_get_error(c->tls, 0);
+	int err = SSL_get_error(c->tls, rv);
 
-	if ((rv == -1) && (err == SSL_ERROR_WANT_WRITE))
+	if ((rv <= 0) && (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ))
 	{
 		D("TLS: send(%d, %d) = retry\n", c->fd.fd, len);
 		errno = EAGAIN;
@@ -157,12 +456,120 @@ int uh_tls_client_send(struct client *c, const char *buf, int len)
 	return rv;
 }
 
+int uh_tls_client_flush(struct client *c)
+{
+	int rv;
+	struct uh_tls_wbuf *wb = SSL_get_app_data(c->tls);
+
+	if (!wb || !wb->len)
+		return 0;
+
+	/* a retried SSL_write() must be given the same buffer */
+	wb->pending = true;
+
+	if ((rv = uh_tls_write(c, wb->data, wb->len)) <= 0)
+	{
+		if (rv == 0)
+			errno = EPIPE;
+
+		return -1;
+	}
+
+	wb->pending = false;
+	wb->written += rv;
+	wb->last = time(NULL);
+	wb->len = 0;
+
+	return 0;
+}
+
+int uh_tls_client_send(struct client *c, const char *buf, int len)
+{
+	int rv, record;
+	int slen = 0;
+	struct uh_tls_wbuf *wb = SSL_get_app_data(c->tls);
+
+	if (!wb)
+		return uh_tls_write(c, buf, len);
+
+	/* start over with small records after the connection went idle */
+	if (!wb->len && (time(NULL) - wb->last) > UH_TLS_RECORD_IDLE)
+		wb->written = 0;
+
+	record = (wb->written < UH_TLS_RECORD_WARMUP)
+		? UH_TLS_RECORD_MIN : UH_TLS_RECORD_MAX;
+
+	while (slen < len)
+	{
+		if (wb->pending || (wb->len >= record))
+		{
+			if (uh_tls_client_flush(c) < 0)
+				return slen ? slen : -1;
+
+			record = (wb->written < UH_TLS_RECORD_WARMUP)
+				? UH_TLS_RECORD_MIN : UH_TLS_RECORD_MAX;
+		}
+
+		/* large writes with an empty buffer need no copy */
+		if (!wb->len && ((len - slen) >= record))
+		{
+			if ((rv = uh_tls_write(c, &buf[slen], record)) <= 0)
+				return slen ? slen : rv;
+
+			wb->written += rv;
+			wb->last = time(NULL);
+			slen += rv;
+			continue;
+		}
+
+		rv = min(len - slen, record - wb->len);
+		memcpy(&wb->data[wb->len], &buf[slen], rv);
+
+		wb->len += rv;
+		slen += rv;
+	}
+
+	return slen;
+}
+
+/* zero-copy file transmission, only possible with kernel TLS */
+ssize_t uh_tls_client_sendfile(struct client *c, int fd, off_t offset, off_t len)
+{
+#if defined(TLS_IS_OPENSSL) && defined(SSL_OP_ENABLE_KTLS)
+	ossl_ssize_t rv;
+
+	if (BIO_get_ktls_send(SSL_get_wbio(c->tls)))
+	{
+		if ((rv = SSL_sendfile(c->tls, fd, offset, len, 0)) < 0)
+		{
+			if (SSL_get_error(c->tls, rv) == SSL_ERROR_WANT_WRITE)
+				errno = EAGAIN;
+			else if ((errno == EAGAIN) || (errno == EINTR))
+				errno = EIO;
+
+			D("TLS: sendfile(%d, %lld) = failed\n", c->fd.fd, (long long)len);
+			return -1;
+		}
+
+		D("TLS: sendfile(%d, %lld) = %lld\n",
+		  c->fd.fd, (long long)len, (long long)rv);
+		return rv;
+	}
+#endif
+
+	errno = ENOSYS;
+	return -1;
+}
+
 void uh_tls_client_close(struct client *c)
 {
 	if (c->tls)
 	{
 		D("TLS: close(%d)\n", c->fd.fd);
 
+		uh_tls_client_flush(c);
+		free(SSL_get_app_data(c->tls));
+
 		SSL_shutdown(c->tls);
 		SSL_free(c->tls);
 
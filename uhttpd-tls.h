@@ -18,19 +18,83 @@
 #ifdef HAVE_TLS
 #ifndef _UHTTPD_TLS_
 
+#include <dirent.h>
 #include <openssl/ssl.h>
 #ifdef TLS_IS_OPENSSL
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
 #endif
+#endif
+
+/* write buffer record sizes, small records until the connection warmed up
+ * or after it went idle get the first bytes to the client sooner */
+#define UH_TLS_RECORD_MIN		1400
+#define UH_TLS_RECORD_MAX		16384
+#define UH_TLS_RECORD_WARMUP	(64 * 1024)
+#define UH_TLS_RECORD_IDLE		1
+
+/* forward secret AEAD suites first, ECDSA before RSA since its handshakes
+ * are much cheaper, plain CBC suites left for old clients */
+#ifndef UH_TLS_CIPHERS
+#define UH_TLS_CIPHERS \
+	"ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-ECDSA-CHACHA20-POLY1305:" \
+	"ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES128-GCM-SHA256:" \
+	"ECDHE-RSA-CHACHA20-POLY1305:ECDHE-RSA-AES256-GCM-SHA384:" \
+	"ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES128-SHA:" \
+	"AES128-GCM-SHA256:AES128-SHA:AES256-SHA"
+#endif
+
+#define UH_TLS_SESSION_CACHE	256
+#define UH_TLS_SESSION_LIFETIME	1800
+
+/* session ticket keys, the newest one encrypts, older ones still decrypt */
+#define UH_TLS_TICKET_KEYS		2
+
+struct uh_tls_wbuf {
+	int len;
+	bool pending;
+	size_t written;
+	time_t last;
+	char data[UH_TLS_RECORD_MAX];
+};
+
+struct uh_tls_ticket_key {
+	unsigned char name[16];
+	unsigned char aes[32];
+	unsigned char hmac[32];
+	time_t created;
+};
+
+/* SNI contexts, loaded from <host>[@tag].crt and .key pairs */
+struct uh_tls_sni {
+	char name[256];
+	SSL_CTX *ctx;
+	struct uh_tls_sni *next;
+};
+
+/* uh_tls_client_accept() results */
+#define UH_TLS_DONE			1
+#define UH_TLS_WANT_READ	0
+#define UH_TLS_WANT_WRITE	2
+#define UH_TLS_FAILED		-1
 
 SSL_CTX * uh_tls_ctx_init();
 int uh_tls_ctx_cert(SSL_CTX *c, const char *file);
 int uh_tls_ctx_key(SSL_CTX *c, const char *file);
+int uh_tls_ctx_cache(SSL_CTX *c, int size, int lifetime);
+int uh_tls_ctx_sni(SSL_CTX *c, const char *dir);
 void uh_tls_ctx_free(struct listener *l);
 
 int uh_tls_client_accept(struct client *c);
 int uh_tls_client_recv(struct client *c, char *buf, int len);
 int uh_tls_client_send(struct client *c, const char *buf, int len);
+int uh_tls_client_flush(struct client *c);
+ssize_t uh_tls_client_sendfile(struct client *c, int fd, off_t offset, off_t len);
 void uh_tls_client_close(struct client *c);
 
 #endif
@@ -740,7 +740,7 @@ uh_ubus_init(const struct config *conf)
 static bool
 uh_ubus_request_parse_url(struct client *cl, char **sid, char **obj, char **fun)
 {
-	char *url = cl->request.url + strlen(cl->server->conf->ubus_prefix);
+	char *url = cl->request.url + strlen(cl->conf->ubus_prefix);
 
 	for (; url && *url == '/'; *url++ = 0);
 	*sid = url;
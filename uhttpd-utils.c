@@ -21,6 +21,8 @@
 
 #include "uhttpd.h"
 #include "uhttpd-utils.h"
+#include "uhttpd-stats.h"
+#include "uhttpd-log.h"
 
 #ifdef HAVE_TLS
 #include "uhttpd-tls.h"
@@ -200,13 +202,114 @@ int uh_raw_send(int fd, const char *buf, int len, int sec)
 
 int uh_tcp_send(struct client *cl, const char *buf, int len)
 {
-	int seconds = cl->server->conf->network_timeout;
+	int rv;
+	int seconds = cl->conf->network_timeout;
+#ifdef HAVE_TLS
+	if (cl->tls)
+		rv = __uh_raw_send(cl, buf, len, seconds, cl->conf->tls_send);
+	else
+#endif
+		rv = __uh_raw_send(cl, buf, len, seconds, uh_tcp_send_lowlevel);
+
+	/* short writes are retried, rv only covers the last one */
+	uh_stats_sent(cl, buf, (rv > 0) ? len : rv);
+
+	return rv;
+}
+
+/* push out data held back by the TLS write buffer */
+int uh_tcp_flush(struct client *cl)
+{
+#ifdef HAVE_TLS
+	if (cl->tls)
+	{
+		while (cl->conf->tls_flush(cl) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if (((errno != EAGAIN) && (errno != EWOULDBLOCK)) ||
+				!uh_socket_wait(cl->fd.fd, cl->conf->network_timeout,
+								true))
+				return -1;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+/* send len bytes from the start of fd, without copying them through
+ * userspace where the kernel allows */
+off_t uh_tcp_sendfile(struct client *cl, int fd, off_t len)
+{
+	ssize_t rv;
+	size_t n;
+	off_t off = 0, pos;
+	char buf[UH_LIMIT_MSGHEAD];
+
 #ifdef HAVE_TLS
 	if (cl->tls)
-		return __uh_raw_send(cl, buf, len, seconds,
-							 cl->server->conf->tls_send);
+		ensure_ret(uh_tcp_flush(cl));
+#endif
+
+	while (off < len)
+	{
+		pos = off;
+		n = min(len - off, UH_LIMIT_SENDFILE);
+
+#ifdef HAVE_TLS
+		if (cl->tls)
+			rv = cl->conf->tls_sendfile(cl, fd, pos, n);
+		else
 #endif
-	return __uh_raw_send(cl, buf, len, seconds, uh_tcp_send_lowlevel);
+			rv = sendfile(cl->fd.fd, fd, &pos, n);
+
+		if (rv > 0)
+		{
+			off += rv;
+			continue;
+		}
+
+		/* file shrunk underneath us */
+		if (rv == 0)
+			return -1;
+
+		if (errno == EINTR)
+			continue;
+
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+		{
+			if (!uh_socket_wait(cl->fd.fd, cl->conf->network_timeout,
+								true))
+				return -1;
+
+			continue;
+		}
+
+		/* not supported for this socket or file, copy */
+		if ((errno == ENOSYS) || (errno == EINVAL))
+			break;
+
+		D("IO: Socket(%d) sendfile error: %s\n", cl->fd.fd, strerror(errno));
+		return -1;
+	}
+
+	uh_stats_sent(cl, NULL, off);
+
+	if ((off < len) && (lseek(fd, off, SEEK_SET) < 0))
+		return -1;
+
+	while (off < len)
+	{
+		if ((rv = read(fd, buf, min(sizeof(buf), len - off))) <= 0)
+			return -1;
+
+		ensure_ret(uh_tcp_send(cl, buf, rv));
+		off += rv;
+	}
+
+	return off;
 }
 
 static int __uh_raw_recv(struct client *cl, char *buf, int len, int sec,
@@ -261,11 +364,11 @@ int uh_raw_recv(int fd, char *buf, int len, int sec)
 
 int uh_tcp_recv(struct client *cl, char *buf, int len)
 {
-	int seconds = cl->server->conf->network_timeout;
+	int seconds = cl->conf->network_timeout;
 #ifdef HAVE_TLS
 	if (cl->tls)
 		return __uh_raw_recv(cl, buf, len, seconds,
-							 cl->server->conf->tls_recv);
+							 cl->conf->tls_recv);
 #endif
 	return __uh_raw_recv(cl, buf, len, seconds, uh_tcp_recv_lowlevel);
 }
@@ -566,11 +669,11 @@ struct path_info * uh_path_lookup(struct client *cl, const char *url)
 	static struct path_info p;
 
 	char buffer[UH_LIMIT_MSGHEAD];
-	char *docroot = cl->server->conf->docroot;
+	char *docroot = cl->conf->docroot;
 	char *pathptr = NULL;
 
 	int slash = 0;
-	int no_sym = cl->server->conf->no_symlinks;
+	int no_sym = cl->conf->no_symlinks;
 	int i = 0;
 	struct stat s;
 
@@ -683,9 +786,9 @@ struct path_info * uh_path_lookup(struct client *cl, const char *url)
 
 				p.redirected = 1;
 			}
-			else if (cl->server->conf->index_file)
+			else if (cl->conf->index_file)
 			{
-				strncat(buffer, cl->server->conf->index_file, sizeof(buffer));
+				strncat(buffer, cl->conf->index_file, sizeof(buffer));
 
 				if (!stat(buffer, &s) && (s.st_mode & S_IFREG))
 				{
@@ -720,9 +823,305 @@ struct path_info * uh_path_lookup(struct client *cl, const char *url)
 }
 
 
-static struct auth_realm *uh_realms = NULL;
+static struct auth_cache_entry
+	uh_auth_cache[UH_AUTH_CACHE_SETS][UH_AUTH_CACHE_WAYS];
+
+static uint8_t uh_auth_cache_key[16];
+static bool uh_auth_cache_keyed = false;
+
+#define SIP_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
 
-struct auth_realm * uh_auth_add(char *path, char *user, char *pass)
+#define SIP_ROUND(v0, v1, v2, v3) do { \
+	v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+	v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2;                        \
+	v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0;                        \
+	v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+} while(0)
+
+static uint64_t uh_siphash_le64(const uint8_t *p)
+{
+	return (uint64_t)p[0]       | (uint64_t)p[1] << 8  |
+	       (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+	       (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+	       (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+/* SipHash-2-4 */
+static uint64_t uh_siphash(const uint8_t *key, const char *data, int len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	uint64_t k0 = uh_siphash_le64(key);
+	uint64_t k1 = uh_siphash_le64(key + 8);
+	uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+	uint64_t m, b = (uint64_t)len << 56;
+	int i;
+
+	for (; len >= 8; len -= 8, p += 8)
+	{
+		m = uh_siphash_le64(p);
+		v3 ^= m;
+		SIP_ROUND(v0, v1, v2, v3);
+		SIP_ROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	for (i = 0; i < len; i++)
+		b |= (uint64_t)p[i] << (8 * i);
+
+	v3 ^= b;
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+void uh_auth_cache_flush(void)
+{
+	memset(uh_auth_cache, 0, sizeof(uh_auth_cache));
+}
+
+static uint64_t uh_auth_cache_hash(const char *cred)
+{
+	int fd;
+	uint64_t hash;
+
+	/* without a secret key the cache stays disabled */
+	if (!uh_auth_cache_keyed)
+	{
+		if ((fd = open("/dev/urandom", O_RDONLY)) < 0)
+			return 0;
+
+		uh_auth_cache_keyed = (read(fd, uh_auth_cache_key,
+			sizeof(uh_auth_cache_key)) == sizeof(uh_auth_cache_key));
+
+		close(fd);
+
+		if (!uh_auth_cache_keyed)
+			return 0;
+	}
+
+	hash = uh_siphash(uh_auth_cache_key, cred, strlen(cred));
+
+	return hash ? hash : 1;
+}
+
+static void uh_auth_trie_free(struct config *conf)
+{
+	free(conf->realm_trie);
+	free(conf->realm_users);
+
+	conf->realm_trie = NULL;
+	conf->realm_users = NULL;
+}
+
+static bool uh_auth_trie_compile(struct config *conf)
+{
+	int order, nodes = 1, users = 0;
+	const char *p;
+	struct auth_realm *realm;
+	struct auth_trie_node *node, *child, *next;
+	struct auth_trie_user *u, *nu;
+
+	for (realm = conf->realms; realm; realm = realm->next)
+	{
+		nodes += strlen(realm->path);
+		users++;
+	}
+
+	conf->realm_trie = calloc(nodes, sizeof(*conf->realm_trie));
+	conf->realm_users = calloc(users ? users : 1, sizeof(*conf->realm_users));
+
+	if (!conf->realm_trie || !conf->realm_users)
+	{
+		uh_auth_trie_free(conf);
+		return false;
+	}
+
+	next = conf->realm_trie + 1;
+	nu = conf->realm_users;
+
+	for (realm = conf->realms, order = 0; realm; realm = realm->next, order++)
+	{
+		node = conf->realm_trie;
+
+		for (p = realm->path; *p; p++)
+		{
+			for (child = node->child; child; child = child->sibling)
+				if (child->c == tolower((unsigned char)*p))
+					break;
+
+			if (!child)
+			{
+				child = next++;
+				child->c = tolower((unsigned char)*p);
+				child->sibling = node->child;
+				node->child = child;
+			}
+
+			node = child;
+		}
+
+		/* earlier realms win, later duplicates are never reachable */
+		if (!node->first)
+		{
+			node->first = realm;
+			node->order = order;
+		}
+
+		for (u = node->users; u; u = u->next)
+			if (!strcmp(u->realm->user, realm->user))
+				break;
+
+		if (!u)
+		{
+			u = nu++;
+			u->realm = realm;
+			u->order = order;
+			u->next = node->users;
+			node->users = u;
+		}
+	}
+
+	return true;
+}
+
+/* first realm in list order whose path prefixes the url, optionally
+ * restricted to the given user */
+static struct auth_realm * uh_auth_realm_find(struct config *conf,
+											  const char *name, const char *user)
+{
+	int rlen, plen, order = -1;
+	const char *p = name;
+	struct auth_realm *realm = NULL;
+	struct auth_trie_node *node;
+	struct auth_trie_user *u;
+
+	if (!conf->realm_trie && conf->realms && !uh_auth_trie_compile(conf))
+	{
+		plen = strlen(name);
+
+		for (realm = conf->realms; realm; realm = realm->next)
+		{
+			rlen = strlen(realm->path);
+
+			if ((plen >= rlen) && !strncasecmp(name, realm->path, rlen) &&
+				(!user || !strcmp(user, realm->user)))
+				return realm;
+		}
+
+		return NULL;
+	}
+
+	for (node = conf->realm_trie; node; )
+	{
+		if (!user)
+		{
+			if (node->first && (order < 0 || node->order < order))
+			{
+				realm = node->first;
+				order = node->order;
+			}
+		}
+		else
+		{
+			for (u = node->users; u; u = u->next)
+			{
+				if (!strcmp(u->realm->user, user))
+				{
+					if (order < 0 || u->order < order)
+					{
+						realm = u->realm;
+						order = u->order;
+					}
+
+					break;
+				}
+			}
+		}
+
+		if (!*p)
+			break;
+
+		for (node = node->child; node; node = node->sibling)
+			if (node->c == tolower((unsigned char)*p))
+				break;
+
+		p++;
+	}
+
+	return realm;
+}
+
+static struct auth_realm * uh_auth_cache_lookup(struct config *conf,
+												uint64_t hash, const char *name)
+{
+	int i;
+	struct timespec now;
+	struct auth_cache_entry *e;
+
+	if (!hash)
+		return NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (i = 0; i < UH_AUTH_CACHE_WAYS; i++)
+	{
+		e = &uh_auth_cache[hash % UH_AUTH_CACHE_SETS][i];
+
+		if ((e->hash != hash) || (e->expires <= now.tv_sec))
+			continue;
+
+		/* only valid if the cached realm is still the first match */
+		if (uh_auth_realm_find(conf, name, e->realm->user) == e->realm)
+			return e->realm;
+	}
+
+	return NULL;
+}
+
+static void uh_auth_cache_store(uint64_t hash, struct auth_realm *realm)
+{
+	int i;
+	struct timespec now;
+	struct auth_cache_entry *e, *victim = NULL;
+
+	if (!hash)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* refresh a matching entry or evict the one expiring first */
+	for (i = 0; i < UH_AUTH_CACHE_WAYS; i++)
+	{
+		e = &uh_auth_cache[hash % UH_AUTH_CACHE_SETS][i];
+
+		if ((e->hash == hash) && (e->realm == realm))
+		{
+			victim = e;
+			break;
+		}
+
+		if (!victim || (e->expires < victim->expires))
+			victim = e;
+	}
+
+	victim->hash    = hash;
+	victim->realm   = realm;
+	victim->expires = now.tv_sec + UH_AUTH_CACHE_TTL;
+}
+
+struct auth_realm * uh_auth_add(struct config *conf,
+							   char *path, char *user, char *pass)
 {
 	struct auth_realm *new = NULL;
 	struct passwd *pwd;
@@ -773,8 +1172,11 @@ struct auth_realm * uh_auth_add(char *path, char *user, char *pass)
 
 		if (new->pass[0])
 		{
-			new->next = uh_realms;
-			uh_realms = new;
+			new->next = conf->realms;
+			conf->realms = new;
+
+			uh_auth_cache_flush();
+			uh_auth_trie_free(conf);
 
 			return new;
 		}
@@ -788,32 +1190,19 @@ struct auth_realm * uh_auth_add(char *path, char *user, char *pass)
 int uh_auth_check(struct client *cl, struct http_request *req,
 				  struct path_info *pi)
 {
-	int i, plen, rlen, protected;
+	int i;
 	char buffer[UH_LIMIT_MSGHEAD];
 	char *user = NULL;
 	char *pass = NULL;
+	uint64_t hash = 0;
 
 	struct auth_realm *realm = NULL;
 
-	plen = strlen(pi->name);
-	protected = 0;
-
-	/* check whether at least one realm covers the requested url */
-	for (realm = uh_realms; realm; realm = realm->next)
-	{
-		rlen = strlen(realm->path);
-
-		if ((plen >= rlen) && !strncasecmp(pi->name, realm->path, rlen))
-		{
-			req->realm = realm;
-			protected = 1;
-			break;
-		}
-	}
-
 	/* requested resource is covered by a realm */
-	if (protected)
+	if ((realm = uh_auth_realm_find(cl->conf, pi->name, NULL)) != NULL)
 	{
+		req->realm = realm;
+
 		/* try to get client auth info */
 		foreach_header(i, req->headers)
 		{
@@ -821,6 +1210,15 @@ int uh_auth_check(struct client *cl, struct http_request *req,
 				(strlen(req->headers[i+1]) > 6) &&
 				!strncasecmp(req->headers[i+1], "Basic ", 6))
 			{
+				hash = uh_auth_cache_hash(&req->headers[i+1][6]);
+
+				/* previously verified against the same realm */
+				if ((realm = uh_auth_cache_lookup(cl->conf, hash, pi->name)) != NULL)
+				{
+					req->realm = realm;
+					return 1;
+				}
+
 				memset(buffer, 0, sizeof(buffer));
 				uh_b64decode(buffer, sizeof(buffer) - 1,
 					(unsigned char *) &req->headers[i+1][6],
@@ -840,18 +1238,8 @@ int uh_auth_check(struct client *cl, struct http_request *req,
 		if (user && pass)
 		{
 			/* find matching realm */
-			for (realm = uh_realms; realm; realm = realm->next)
-			{
-				rlen = strlen(realm->path);
-
-				if ((plen >= rlen) &&
-					!strncasecmp(pi->name, realm->path, rlen) &&
-					!strcmp(user, realm->user))
-				{
-					req->realm = realm;
-					break;
-				}
-			}
+			if ((realm = uh_auth_realm_find(cl->conf, pi->name, user)) != NULL)
+				req->realm = realm;
 
 			/* found a realm matching the username */
 			if (realm)
@@ -859,7 +1247,10 @@ int uh_auth_check(struct client *cl, struct http_request *req,
 				/* check user pass */
 				if (!strcmp(pass, realm->pass) ||
 				    !strcmp(crypt(pass, realm->pass), realm->pass))
+				{
+					uh_auth_cache_store(hash, realm);
 					return 1;
+				}
 			}
 		}
 
@@ -870,7 +1261,7 @@ int uh_auth_check(struct client *cl, struct http_request *req,
 			"Content-Type: text/plain\r\n"
 			"Content-Length: 23\r\n\r\n"
 			"Authorization Required\n",
-				req->version, cl->server->conf->realm
+				req->version, cl->conf->realm
 		);
 
 		return 0;
@@ -883,6 +1274,49 @@ int uh_auth_check(struct client *cl, struct http_request *req,
 static struct listener *uh_listeners = NULL;
 static struct client *uh_clients = NULL;
 
+struct config * uh_config_get(struct config *conf)
+{
+	conf->refcount++;
+	return conf;
+}
+
+void uh_config_put(struct config *conf)
+{
+	struct auth_realm *realm;
+#ifdef HAVE_CGI
+	struct interpreter *ipr;
+#endif
+
+	if (--conf->refcount > 0)
+		return;
+
+	D("SRV: Config generation %p released\n", conf);
+
+	/* cached credentials point into the realm list */
+	if (conf->realms)
+		uh_auth_cache_flush();
+
+	while ((realm = conf->realms) != NULL)
+	{
+		conf->realms = realm->next;
+		free(realm);
+	}
+
+	uh_auth_trie_free(conf);
+
+#ifdef HAVE_CGI
+	while ((ipr = conf->interpreters) != NULL)
+	{
+		conf->interpreters = ipr->next;
+		free(ipr);
+	}
+#endif
+
+	free(conf->index_file);
+	free(conf->error_handler);
+	free(conf);
+}
+
 struct listener * uh_listener_add(int sock, struct config *conf)
 {
 	struct listener *new = NULL;
@@ -910,6 +1344,20 @@ struct listener * uh_listener_add(int sock, struct config *conf)
 	return NULL;
 }
 
+/* move all listeners to a new config generation */
+void uh_listener_update(struct config *conf)
+{
+	struct listener *cur = NULL;
+
+	for (cur = uh_listeners; cur; cur = cur->next)
+		cur->conf = conf;
+}
+
+struct listener * uh_listener_first(void)
+{
+	return uh_listeners;
+}
+
 struct listener * uh_listener_lookup(int sock)
 {
 	struct listener *cur = NULL;
@@ -922,10 +1370,10 @@ struct listener * uh_listener_lookup(int sock)
 }
 
 
-struct client * uh_client_add(int sock, struct listener *serv)
+struct client * uh_client_add(int sock, struct listener *serv,
+							  struct sockaddr_in6 *peer)
 {
 	struct client *new = NULL;
-	socklen_t sl;
 
 	if ((new = (struct client *)malloc(sizeof(struct client))) != NULL)
 	{
@@ -933,16 +1381,12 @@ struct client * uh_client_add(int sock, struct listener *serv)
 
 		new->fd.fd  = sock;
 		new->server = serv;
+		new->conf   = uh_config_get(serv->conf);
 
-		/* get remote endpoint addr */
-		sl = sizeof(struct sockaddr_in6);
-		memset(&(new->peeraddr), 0, sl);
-		getpeername(sock, (struct sockaddr *) &(new->peeraddr), &sl);
+		uh_stats_mark(new, UH_STATS_ACCEPT);
 
-		/* get local endpoint addr */
-		sl = sizeof(struct sockaddr_in6);
-		memset(&(new->servaddr), 0, sl);
-		getsockname(sock, (struct sockaddr *) &(new->servaddr), &sl);
+		/* remote endpoint addr as returned by accept() */
+		memcpy(&(new->peeraddr), peer, sizeof(new->peeraddr));
 
 		new->next = uh_clients;
 		uh_clients = new;
@@ -953,6 +1397,22 @@ struct client * uh_client_add(int sock, struct listener *serv)
 	return new;
 }
 
+/* local endpoint addr, only looked up when needed */
+struct sockaddr_in6 * uh_client_servaddr(struct client *cl)
+{
+	socklen_t sl = sizeof(struct sockaddr_in6);
+
+	if (!cl->servaddr.sin6_family)
+		getsockname(cl->fd.fd, (struct sockaddr *) &(cl->servaddr), &sl);
+
+	return &cl->servaddr;
+}
+
+struct client * uh_client_first(void)
+{
+	return uh_clients;
+}
+
 struct client * uh_client_lookup(int sock)
 {
 	struct client *cur = NULL;
@@ -968,8 +1428,11 @@ void uh_client_shutdown(struct client *cl)
 {
 #ifdef HAVE_TLS
 	/* free client tls context */
-	if (cl->server && cl->server->conf->tls)
-		cl->server->conf->tls_close(cl);
+	if (cl->server && cl->conf->tls)
+	{
+		uh_tcp_flush(cl);
+		cl->conf->tls_close(cl);
+	}
 #endif
 
 	/* remove from global client list */
@@ -1002,6 +1465,18 @@ void uh_client_remove(struct client *cl)
 			D("IO: Socket(%d) closing\n", cur->fd.fd);
 			cur->server->n_clients--;
 
+			/* back below capacity, resume accepting */
+			if (cur->server->paused && (cur->server->fd.fd > -1) &&
+				(cur->server->n_clients < cur->server->conf->max_requests))
+			{
+				D("SRV: Server(%d) resumed\n", cur->server->fd.fd);
+				cur->server->paused = false;
+				uloop_fd_add(&cur->server->fd, ULOOP_READ);
+			}
+
+			uh_log_done(cur);
+			uh_stats_done(cur);
+			uh_config_put(cur->conf);
 			free(cur);
 			break;
 		}
@@ -1010,9 +1485,8 @@ void uh_client_remove(struct client *cl)
 
 
 #ifdef HAVE_CGI
-static struct interpreter *uh_interpreters = NULL;
-
-struct interpreter * uh_interpreter_add(const char *extn, const char *path)
+struct interpreter * uh_interpreter_add(struct config *conf,
+										const char *extn, const char *path)
 {
 	struct interpreter *new = NULL;
 
@@ -1023,8 +1497,8 @@ struct interpreter * uh_interpreter_add(const char *extn, const char *path)
 		memcpy(new->extn, extn, min(strlen(extn), sizeof(new->extn)-1));
 		memcpy(new->path, path, min(strlen(path), sizeof(new->path)-1));
 
-		new->next = uh_interpreters;
-		uh_interpreters = new;
+		new->next = conf->interpreters;
+		conf->interpreters = new;
 
 		return new;
 	}
@@ -1032,12 +1506,13 @@ struct interpreter * uh_interpreter_add(const char *extn, const char *path)
 	return NULL;
 }
 
-struct interpreter * uh_interpreter_lookup(const char *path)
+struct interpreter * uh_interpreter_lookup(struct config *conf,
+										   const char *path)
 {
 	struct interpreter *cur = NULL;
 	const char *e;
 
-	for (cur = uh_interpreters; cur; cur = cur->next)
+	for (cur = conf->interpreters; cur; cur = cur->next)
 	{
 		e = &path[max(strlen(path) - strlen(cur->extn), 0)];
 
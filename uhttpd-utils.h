@@ -19,9 +19,11 @@
 #ifndef _UHTTPD_UTILS_
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <pwd.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 
 #ifdef HAVE_SHADOW
 #include <shadow.h>
@@ -73,6 +75,8 @@ int uh_raw_send(int fd, const char *buf, int len, int seconds);
 int uh_raw_recv(int fd, char *buf, int len, int seconds);
 int uh_tcp_send(struct client *cl, const char *buf, int len);
 int uh_tcp_send_lowlevel(struct client *cl, const char *buf, int len);
+int uh_tcp_flush(struct client *cl);
+off_t uh_tcp_sendfile(struct client *cl, int fd, off_t len);
 int uh_tcp_recv(struct client *cl, char *buf, int len);
 int uh_tcp_recv_lowlevel(struct client *cl, char *buf, int len);
 
@@ -100,7 +104,36 @@ int uh_urlencode(char *buf, int blen, const char *src, int slen);
 int uh_b64decode(char *buf, int blen, const unsigned char *src, int slen);
 
 
-struct auth_realm * uh_auth_add(char *path, char *user, char *pass);
+/* verified Basic credentials, so repeated requests skip crypt() */
+#define UH_AUTH_CACHE_SETS	16
+#define UH_AUTH_CACHE_WAYS	4
+#define UH_AUTH_CACHE_TTL	60
+
+struct auth_cache_entry {
+	uint64_t hash;
+	struct auth_realm *realm;
+	time_t expires;
+};
+
+/* realms compiled into a case-insensitive prefix trie, ranked by list order */
+struct auth_trie_user {
+	struct auth_realm *realm;
+	int order;
+	struct auth_trie_user *next;
+};
+
+struct auth_trie_node {
+	struct auth_trie_node *child;
+	struct auth_trie_node *sibling;
+	struct auth_realm *first;
+	int order;
+	struct auth_trie_user *users;
+	char c;
+};
+
+struct auth_realm * uh_auth_add(struct config *conf,
+							   char *path, char *user, char *pass);
+void uh_auth_cache_flush(void);
 
 int uh_auth_check(
 	struct client *cl, struct http_request *req, struct path_info *pi
@@ -109,10 +142,18 @@ int uh_auth_check(
 
 struct path_info * uh_path_lookup(struct client *cl, const char *url);
 
+struct config * uh_config_get(struct config *conf);
+void uh_config_put(struct config *conf);
+
 struct listener * uh_listener_add(int sock, struct config *conf);
+void uh_listener_update(struct config *conf);
+struct listener * uh_listener_first(void);
 struct listener * uh_listener_lookup(int sock);
 
-struct client * uh_client_add(int sock, struct listener *serv);
+struct client * uh_client_add(int sock, struct listener *serv,
+							  struct sockaddr_in6 *peer);
+struct sockaddr_in6 * uh_client_servaddr(struct client *cl);
+struct client * uh_client_first(void);
 struct client * uh_client_lookup(int sock);
 
 #define uh_client_error(cl, code, status, ...) do { \
@@ -127,8 +168,10 @@ void uh_client_remove(struct client *cl);
 
 
 #ifdef HAVE_CGI
-struct interpreter * uh_interpreter_add(const char *extn, const char *path);
-struct interpreter * uh_interpreter_lookup(const char *path);
+struct interpreter * uh_interpreter_add(struct config *conf,
+										const char *extn, const char *path);
+struct interpreter * uh_interpreter_lookup(struct config *conf,
+										   const char *path);
 #endif
 
 #endif
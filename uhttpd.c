@@ -16,11 +16,13 @@
  *  limitations under the License.
  */
 
-#define _XOPEN_SOURCE 500	/* crypt() */
+#define _GNU_SOURCE		/* crypt(), setenv(), accept4() */
 
 #include "uhttpd.h"
 #include "uhttpd-utils.h"
 #include "uhttpd-file.h"
+#include "uhttpd-stats.h"
+#include "uhttpd-log.h"
 
 #ifdef HAVE_CGI
 #include "uhttpd-cgi.h"
@@ -33,22 +35,49 @@
 #ifdef HAVE_TLS
 #include "uhttpd-tls.h"
 #endif
-struct addrinfo {
-    int     ai_flags;
-    int     ai_family;
-    int     ai_socktype;
-    int     ai_protocol;
-    size_t  ai_addrlen;
-    struct  sockaddr *ai_addr;
-    char    *ai_canonname;     /* canonical name */
-    struct  addrinfo *ai_next; /* this struct can form a linked list */
-};
 
 static int run = 1;
+static int reload = 0;
+static int upgrade = 0;
+
+static struct config *uh_conf = NULL;
+
+/* listening sockets passed in by a previous instance or a service manager */
+static struct {
+	int fd;
+	bool tls;
+	bool used;
+} uh_inherited[UH_LIMIT_LISTENERS];
+
+static int uh_n_inherited = 0;
+
+static char **uh_argv = NULL;
+static char uh_exe[PATH_MAX];
+
+static struct uloop_timeout uh_drain;
 
 static void uh_sigterm(int sig)
 {
 	run = 0;
+	uloop_end();
+}
+
+static void uh_sighup(int sig)
+{
+	reload = 1;
+	uloop_end();
+}
+
+static void uh_sigusr2(int sig)
+{
+	upgrade = 1;
+	uloop_end();
+}
+
+static void uh_sigusr1(int sig)
+{
+	if (uh_conf)
+		uh_log_reopen(uh_conf->log);
 }
 
 static void uh_config_parse(struct config *conf)
@@ -77,7 +106,7 @@ static void uh_config_parse(struct config *conf)
 					continue;
 				}
 
-				if (!uh_auth_add(line, col1, col2))
+				if (!uh_auth_add(conf, line, col1, col2))
 				{
 					fprintf(stderr,
 							"Notice: No password set for user %s, ignoring "
@@ -93,6 +122,7 @@ static void uh_config_parse(struct config *conf)
 				   	continue;
 				}
 
+				free(conf->index_file);
 				conf->index_file = strdup(col1);
 			}
 			else if (!strncmp(line, "E404:", 5))
@@ -103,6 +133,7 @@ static void uh_config_parse(struct config *conf)
 					continue;
 				}
 
+				free(conf->error_handler);
 				conf->error_handler = strdup(col1);
 			}
 #ifdef HAVE_CGI
@@ -115,7 +146,7 @@ static void uh_config_parse(struct config *conf)
 					continue;
 				}
 
-				if (!uh_interpreter_add(col1, col2))
+				if (!uh_interpreter_add(conf, col1, col2))
 				{
 					fprintf(stderr,
 							"Unable to add interpreter %s for extension %s: "
@@ -130,8 +161,194 @@ static void uh_config_parse(struct config *conf)
 	}
 }
 
+/* derive a new config generation from the command line options in base
+ * and the current contents of the config file */
+static struct config * uh_config_load(struct config *base)
+{
+	struct config *conf;
+#ifdef HAVE_CGI
+	struct interpreter *ipr, **tail;
+#endif
+
+	if (!(conf = malloc(sizeof(*conf))))
+		return NULL;
+
+	memcpy(conf, base, sizeof(*conf));
+
+	conf->refcount    = 1;
+	conf->realms      = NULL;
+	conf->realm_trie  = NULL;
+	conf->realm_users = NULL;
+
+	conf->index_file    = base->index_file ? strdup(base->index_file) : NULL;
+	conf->error_handler = base->error_handler ? strdup(base->error_handler) : NULL;
+
+#ifdef HAVE_CGI
+	/* copy -i interpreters, keeping their order */
+	tail = &conf->interpreters;
+
+	for (ipr = base->interpreters; ipr; ipr = ipr->next)
+	{
+		if (!(*tail = malloc(sizeof(**tail))))
+			break;
+
+		memcpy(*tail, ipr, sizeof(**tail));
+		tail = &(*tail)->next;
+	}
+
+	*tail = NULL;
+#endif
+
+	uh_config_parse(conf);
+
+	return conf;
+}
+
+/* swap in a new generation, clients still running on the old one keep
+ * it alive until they are done */
+static void uh_config_reload(struct config *base)
+{
+	struct config *conf;
+
+	if (!(conf = uh_config_load(base)))
+	{
+		fprintf(stderr, "Error: Unable to reload configuration: %s\n",
+				strerror(errno));
+		return;
+	}
+
+	D("SRV: Config generation %p replaces %p\n", conf, uh_conf);
+
+	uh_listener_update(conf);
+	uh_config_put(uh_conf);
+	uh_conf = conf;
+}
+
+static bool uh_sockaddr_equal(struct sockaddr *a, struct sockaddr *b)
+{
+	struct sockaddr_in *a4 = (struct sockaddr_in *)a;
+	struct sockaddr_in *b4 = (struct sockaddr_in *)b;
+	struct sockaddr_in6 *a6 = (struct sockaddr_in6 *)a;
+	struct sockaddr_in6 *b6 = (struct sockaddr_in6 *)b;
+
+	if (a->sa_family != b->sa_family)
+		return false;
+
+	if (a->sa_family == AF_INET)
+		return (a4->sin_port == b4->sin_port) &&
+			(a4->sin_addr.s_addr == b4->sin_addr.s_addr);
+
+	if (a->sa_family == AF_INET6)
+		return (a6->sin6_port == b6->sin6_port) &&
+			!memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr));
+
+	return false;
+}
+
+/* pick up sockets from LISTEN_FDS, starting at fd 3 */
+static void uh_socket_inherit(void)
+{
+	int i, n, one;
+	socklen_t sl;
+	char *pid = getenv("LISTEN_PID");
+	char *fds = getenv("LISTEN_FDS");
+	char *names = getenv("LISTEN_FDNAMES");
+	char *name = NULL;
+
+	if (!pid || !fds || (atoi(pid) != getpid()))
+		goto out;
+
+	n = min(atoi(fds), UH_LIMIT_LISTENERS);
+
+	for (i = 0; i < n; i++)
+	{
+		if (names)
+		{
+			name = names;
+
+			if ((names = strchr(names, ':')) != NULL)
+				*names++ = 0;
+		}
+
+		sl = sizeof(one);
+
+		if (getsockopt(3 + i, SOL_SOCKET, SO_ACCEPTCONN, &one, &sl) || !one)
+		{
+			fprintf(stderr, "Notice: Inherited fd %d is not a listening "
+					"socket, ignoring\n", 3 + i);
+			continue;
+		}
+
+		fd_cloexec(3 + i);
+
+		uh_inherited[uh_n_inherited].fd   = 3 + i;
+		uh_inherited[uh_n_inherited].tls  = name && !strcmp(name, "https");
+		uh_inherited[uh_n_inherited].used = false;
+		uh_n_inherited++;
+	}
+
+out:
+	/* not meant for CGI children */
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+}
+
+static int uh_socket_inherited(struct addrinfo *p)
+{
+	int i;
+	socklen_t sl;
+	struct sockaddr_in6 addr;
+
+	for (i = 0; i < uh_n_inherited; i++)
+	{
+		sl = sizeof(addr);
+
+		if (uh_inherited[i].used ||
+			getsockname(uh_inherited[i].fd, (struct sockaddr *)&addr, &sl))
+			continue;
+
+		if (uh_sockaddr_equal((struct sockaddr *)&addr, p->ai_addr))
+		{
+			uh_inherited[i].used = true;
+			return uh_inherited[i].fd;
+		}
+	}
+
+	return -1;
+}
+
 static void uh_listener_cb(struct uloop_fd *u, unsigned int events);
 
+static struct listener * uh_socket_listen(fd_set *serv_fds, int *max_fd,
+										  int sock, int do_tls,
+										  struct config *conf)
+{
+	struct listener *l = NULL;
+
+	/* add listener to global list */
+	if (!(l = uh_listener_add(sock, conf)))
+	{
+		fprintf(stderr, "uh_listener_add(): Failed to allocate memory\n");
+		return NULL;
+	}
+
+#ifdef HAVE_TLS
+	/* init TLS */
+	l->tls = do_tls ? conf->tls : NULL;
+#endif
+
+	/* add socket to server fd set */
+	FD_SET(sock, serv_fds);
+	fd_cloexec(sock);
+	*max_fd = max(*max_fd, sock);
+
+	l->fd.cb = uh_listener_cb;
+	uloop_fd_add(&l->fd, ULOOP_READ);
+
+	return l;
+}
+
 static int uh_socket_bind(fd_set *serv_fds, int *max_fd,
 						  const char *host, const char *port,
 						  struct addrinfo *hints, int do_tls,
@@ -142,9 +359,9 @@ static int uh_socket_bind(fd_set *serv_fds, int *max_fd,
 	int status;
 	int bound = 0;
 
+	int inherited;
 	int tcp_ka_idl, tcp_ka_int, tcp_ka_cnt;
 
-	struct listener *l = NULL;
 	struct addrinfo *addrs = NULL, *p = NULL;
 
 	if ((status = getaddrinfo(host, port, hints, &addrs)) != 0)
@@ -155,15 +372,20 @@ static int uh_socket_bind(fd_set *serv_fds, int *max_fd,
 	/* try to bind a new socket to each found address */
 	for (p = addrs; p; p = p->ai_next)
 	{
+		/* already bound and listening in a previous instance */
+		inherited = ((sock = uh_socket_inherited(p)) > -1);
+
 		/* get the socket */
-		if ((sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+		if (!inherited &&
+			(sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
 		{
 			perror("socket()");
 			goto error;
 		}
 
 		/* "address already in use" */
-		if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)))
+		if (!inherited &&
+			setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)))
 		{
 			perror("setsockopt()");
 			goto error;
@@ -187,7 +409,7 @@ static int uh_socket_bind(fd_set *serv_fds, int *max_fd,
 		}
 
 		/* required to get parallel v4 + v6 working */
-		if (p->ai_family == AF_INET6)
+		if (!inherited && (p->ai_family == AF_INET6))
 		{
 			if (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(yes)) == -1)
 			{
@@ -197,38 +419,21 @@ static int uh_socket_bind(fd_set *serv_fds, int *max_fd,
 		}
 
 		/* bind */
-		if (bind(sock, p->ai_addr, p->ai_addrlen) == -1)
+		if (!inherited && (bind(sock, p->ai_addr, p->ai_addrlen) == -1))
 		{
 			perror("bind()");
 			goto error;
 		}
 
 		/* listen */
-		if (listen(sock, UH_LIMIT_CLIENTS) == -1)
+		if (!inherited && (listen(sock, UH_LIMIT_CLIENTS) == -1))
 		{
 			perror("listen()");
 			goto error;
 		}
 
-		/* add listener to global list */
-		if (!(l = uh_listener_add(sock, conf)))
-		{
-			fprintf(stderr, "uh_listener_add(): Failed to allocate memory\n");
+		if (!uh_socket_listen(serv_fds, max_fd, sock, do_tls, conf))
 			goto error;
-		}
-
-#ifdef HAVE_TLS
-		/* init TLS */
-		l->tls = do_tls ? conf->tls : NULL;
-#endif
-
-		/* add socket to server fd set */
-		FD_SET(sock, serv_fds);
-		fd_cloexec(sock);
-		*max_fd = max(*max_fd, sock);
-
-		l->fd.cb = uh_listener_cb;
-		uloop_fd_add(&l->fd, ULOOP_READ | ULOOP_WRITE);
 
 		bound++;
 		continue;
@@ -243,6 +448,186 @@ static int uh_socket_bind(fd_set *serv_fds, int *max_fd,
 	return bound;
 }
 
+/* serve inherited sockets that no -p or -s option asked for */
+static int uh_socket_adopt(fd_set *serv_fds, int *max_fd, struct config *conf)
+{
+	int i;
+	int bound = 0;
+
+	for (i = 0; i < uh_n_inherited; i++)
+	{
+		if (uh_inherited[i].used)
+			continue;
+
+		uh_inherited[i].used = true;
+
+#ifdef HAVE_TLS
+		if (uh_inherited[i].tls && !conf->tls)
+#else
+		if (uh_inherited[i].tls)
+#endif
+		{
+			fprintf(stderr, "Notice: TLS support is disabled, closing "
+					"inherited HTTPS socket %d\n", uh_inherited[i].fd);
+
+			close(uh_inherited[i].fd);
+			continue;
+		}
+
+		if (!uh_socket_listen(serv_fds, max_fd, uh_inherited[i].fd,
+							  uh_inherited[i].tls, conf))
+		{
+			close(uh_inherited[i].fd);
+			continue;
+		}
+
+		bound++;
+	}
+
+	return bound;
+}
+
+static void uh_drain_cb(struct uloop_timeout *t)
+{
+	struct listener *l;
+
+	for (l = uh_listener_first(); l; l = l->next)
+	{
+		if (l->n_clients > 0)
+		{
+			uloop_timeout_set(t, 250);
+			return;
+		}
+	}
+
+	D("SRV: All clients drained, exiting\n");
+
+	run = 0;
+	uloop_end();
+}
+
+/* runs in the forked child, hands the listeners to the new binary as
+ * fds 3 and up; exec failures are reported back through err_fd */
+static void uh_upgrade_exec(int err_fd)
+{
+	int i, n = 0;
+	int fds[UH_LIMIT_LISTENERS];
+	char buf[16];
+	char names[UH_LIMIT_LISTENERS * 6] = { 0 };
+	struct listener *l;
+
+	for (l = uh_listener_first(); l && (n < UH_LIMIT_LISTENERS); l = l->next)
+		n++;
+
+	/* move everything out of the target range first */
+	err_fd = fcntl(err_fd, F_DUPFD, 3 + n);
+	fd_cloexec(err_fd);
+
+	for (l = uh_listener_first(), i = 0; i < n; l = l->next, i++)
+	{
+		fds[i] = fcntl(l->fd.fd, F_DUPFD, 3 + n);
+
+#ifdef HAVE_TLS
+		strcat(names, l->tls ? "https:" : "http:");
+#else
+		strcat(names, "http:");
+#endif
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		dup2(fds[i], 3 + i);
+		close(fds[i]);
+	}
+
+	if (n > 0)
+		names[strlen(names) - 1] = 0;
+
+	snprintf(buf, sizeof(buf), "%d", n);
+	setenv("LISTEN_FDS", buf, 1);
+
+	snprintf(buf, sizeof(buf), "%d", getpid());
+	setenv("LISTEN_PID", buf, 1);
+
+	setenv("LISTEN_FDNAMES", names, 1);
+
+	if (strchr(uh_exe, '/'))
+		execv(uh_exe, uh_argv);
+	else
+		execvp(uh_exe, uh_argv);
+
+	i = errno;
+
+	if (write(err_fd, &i, sizeof(i)) < 0)
+		perror("write()");
+
+	_exit(1);
+}
+
+/* SIGUSR2: start the binary again on our listeners, then stop accepting
+ * and exit once the remaining clients are done */
+static void uh_upgrade(void)
+{
+	int err, rlen;
+	int pfd[2];
+	struct listener *l;
+
+	if (uh_drain.pending)
+		return;
+
+	if (pipe(pfd))
+	{
+		perror("pipe()");
+		return;
+	}
+
+	fd_cloexec(pfd[0]);
+	fd_cloexec(pfd[1]);
+
+	switch (fork())
+	{
+		case -1:
+			perror("fork()");
+			close(pfd[0]);
+			close(pfd[1]);
+			return;
+
+		case 0:
+			close(pfd[0]);
+			uh_upgrade_exec(pfd[1]);
+			break;
+	}
+
+	close(pfd[1]);
+
+	/* the pipe is closed by a successful exec */
+	do {
+		rlen = read(pfd[0], &err, sizeof(err));
+	} while ((rlen < 0) && (errno == EINTR));
+
+	close(pfd[0]);
+
+	if (rlen == sizeof(err))
+	{
+		fprintf(stderr, "Error: Unable to execute %s: %s\n",
+				uh_exe, strerror(err));
+		return;
+	}
+
+	D("SRV: Listeners handed over, draining\n");
+
+	for (l = uh_listener_first(); l; l = l->next)
+	{
+		uloop_fd_delete(&l->fd);
+		close(l->fd.fd);
+		l->fd.fd = -1;
+	}
+
+	uh_drain.cb = uh_drain_cb;
+	uh_drain_cb(&uh_drain);
+}
+
+
 static struct http_request * uh_http_header_parse(struct client *cl,
 												  char *buffer, int buflen)
 {
@@ -452,14 +837,26 @@ static int uh_path_match(const char *prefix, const char *url)
 static bool uh_dispatch_request(struct client *cl, struct http_request *req)
 {
 	struct path_info *pin;
+	struct path_info stats = { .name = cl->conf->stats_url };
 	struct interpreter *ipr = NULL;
-	struct config *conf = cl->server->conf;
+	struct config *conf = cl->conf;
+
+	/* status page? protected by the realm covering its url */
+	if (uh_stats_match(cl, req->url))
+	{
+		if (!uh_auth_check(cl, req, &stats))
+			return false;
+
+		uh_stats_dispatch(cl, UH_STATS_OTHER);
+		return uh_stats_request(cl, req);
+	}
 
 #ifdef HAVE_LUA
 	/* Lua request? */
 	if (conf->lua_state &&
 		uh_path_match(conf->lua_prefix, req->url))
 	{
+		uh_stats_dispatch(cl, UH_STATS_LUA);
 		return conf->lua_request(cl, conf->lua_state);
 	}
 	else
@@ -470,6 +867,7 @@ static bool uh_dispatch_request(struct client *cl, struct http_request *req)
 	if (conf->ubus_state &&
 		uh_path_match(conf->ubus_prefix, req->url))
 	{
+		uh_stats_dispatch(cl, UH_STATS_UBUS);
 		return conf->ubus_request(cl, conf->ubus_state);
 	}
 	else
@@ -483,11 +881,13 @@ static bool uh_dispatch_request(struct client *cl, struct http_request *req)
 		{
 #ifdef HAVE_CGI
 			if (uh_path_match(conf->cgi_prefix, pin->name) ||
-				(ipr = uh_interpreter_lookup(pin->phys)) != NULL)
+				(ipr = uh_interpreter_lookup(conf, pin->phys)) != NULL)
 			{
+				uh_stats_dispatch(cl, UH_STATS_CGI);
 				return uh_cgi_request(cl, pin, ipr);
 			}
 #endif
+			uh_stats_dispatch(cl, UH_STATS_FILE);
 			return uh_file_request(cl, pin);
 		}
 	}
@@ -504,11 +904,13 @@ static bool uh_dispatch_request(struct client *cl, struct http_request *req)
 				req->redirect_status = 404;
 #ifdef HAVE_CGI
 				if (uh_path_match(conf->cgi_prefix, pin->name) ||
-					(ipr = uh_interpreter_lookup(pin->phys)) != NULL)
+					(ipr = uh_interpreter_lookup(conf, pin->phys)) != NULL)
 				{
+					uh_stats_dispatch(cl, UH_STATS_CGI);
 					return uh_cgi_request(cl, pin, ipr);
 				}
 #endif
+				uh_stats_dispatch(cl, UH_STATS_FILE);
 				return uh_file_request(cl, pin);
 			}
 		}
@@ -525,9 +927,112 @@ static bool uh_dispatch_request(struct client *cl, struct http_request *req)
 
 static void uh_client_cb(struct uloop_fd *u, unsigned int events);
 
+/* with -e, the socket is edge-triggered until the request is dispatched:
+ * the TLS handshake runs until it wants more data and the header read
+ * waits for the full header itself (uh_socket_wait, -T), so neither needs
+ * to be woken again for data that is already queued */
+static void uh_client_poll(struct client *cl, unsigned int events)
+{
+	if (cl->conf->edge_trigger && !cl->dispatched)
+		events |= ULOOP_EDGE_TRIGGER;
+
+	uloop_fd_add(&cl->fd, events);
+}
+
+#ifdef HAVE_TLS
+static void uh_handshake_timeout_cb(struct uloop_timeout *t)
+{
+	struct client *cl = container_of(t, struct client, timeout);
+
+	D("SRV: Client(%d) SSL handshake timed out, drop\n", cl->fd.fd);
+
+	cl->conf->tls_stats->timeouts++;
+	uh_client_shutdown(cl);
+}
+
+static void uh_client_handshake(struct client *cl)
+{
+	unsigned long us;
+	struct timespec now;
+	struct config *conf = cl->conf;
+
+	switch (conf->tls_accept(cl))
+	{
+	case UH_TLS_DONE:
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		us = (now.tv_sec - cl->handshake_start.tv_sec) * 1000000 +
+			(now.tv_nsec - cl->handshake_start.tv_nsec) / 1000;
+
+		conf->tls_stats->handshakes++;
+		conf->tls_stats->latency_us += us;
+		conf->tls_stats->latency_max_us = max(conf->tls_stats->latency_max_us, us);
+
+		D("SRV: Client(%d) SSL handshake done in %luus\n", cl->fd.fd, us);
+
+		uloop_timeout_cancel(&cl->timeout);
+		cl->handshaking = false;
+
+		uh_client_poll(cl, ULOOP_READ | ULOOP_WRITE);
+		break;
+
+	case UH_TLS_WANT_READ:
+		uh_client_poll(cl, ULOOP_READ);
+		break;
+
+	case UH_TLS_WANT_WRITE:
+		uh_client_poll(cl, ULOOP_WRITE);
+		break;
+
+	default:
+		D("SRV: Client(%d) SSL handshake failed, drop\n", cl->fd.fd);
+
+		conf->tls_stats->failures++;
+		uh_client_remove(cl);
+		break;
+	}
+}
+#endif
+
+/* sent to connections beyond max_requests when -B is given */
+static const char uh_overload_msg[] =
+	"HTTP/1.0 503 Service Unavailable\r\n"
+	"Content-Type: text/plain\r\n"
+	"Content-Length: 20\r\n"
+	"Retry-After: 1\r\n"
+	"Connection: close\r\n\r\n"
+	"Service Unavailable\n";
+
+static void uh_listener_shed(struct listener *serv)
+{
+	int fd;
+	int tls = 0;
+
+#ifdef HAVE_TLS
+	tls = (serv->tls != NULL);
+#endif
+
+	while ((fd = accept4(serv->fd.fd, NULL, NULL,
+						 SOCK_NONBLOCK | SOCK_CLOEXEC)) > -1)
+	{
+		D("SRV: Server(%d) overloaded, shedding Client(%d)\n",
+		  serv->fd.fd, fd);
+
+		/* no cheap way to answer a TLS client before the handshake */
+		if (!tls)
+			send(fd, uh_overload_msg, sizeof(uh_overload_msg) - 1,
+				 MSG_NOSIGNAL | MSG_DONTWAIT);
+
+		close(fd);
+		serv->conf->conn_stats->shed++;
+	}
+}
+
 static void uh_listener_cb(struct uloop_fd *u, unsigned int events)
 {
-	int new_fd;
+	int i, new_fd;
+	socklen_t sl;
+	struct sockaddr_in6 peer;
 	struct listener *serv;
 	struct client *cl;
 	struct config *conf;
@@ -535,38 +1040,65 @@ static void uh_listener_cb(struct uloop_fd *u, unsigned int events)
 	serv = container_of(u, struct listener, fd);
 	conf = serv->conf;
 
-	/* defer client if maximum number of requests is exceeded */
-	if (serv->n_clients >= conf->max_requests)
-		return;
-
-	/* handle new connections */
-	if ((new_fd = accept(u->fd, NULL, 0)) != -1)
+	/* drain a batch of pending connections per wakeup */
+	for (i = 0; i < UH_LIMIT_ACCEPT; i++)
 	{
+		/* at capacity, either turn the excess away or stop polling the
+		 * listener until a client is removed */
+		if (serv->n_clients >= conf->max_requests)
+		{
+			if (conf->shed_overload)
+			{
+				uh_listener_shed(serv);
+				return;
+			}
+
+			D("SRV: Server(%d) at capacity, paused\n", u->fd);
+
+			conf->conn_stats->deferred++;
+			serv->paused = true;
+			uloop_fd_delete(u);
+			return;
+		}
+
+		sl = sizeof(peer);
+		memset(&peer, 0, sizeof(peer));
+
+		/* handle new connections */
+		if ((new_fd = accept4(u->fd, (struct sockaddr *)&peer, &sl,
+							  SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1)
+		{
+			if ((errno == EINTR) || (errno == ECONNABORTED))
+				continue;
+
+			return;
+		}
+
 		D("SRV: Server(%d) accept => Client(%d)\n", u->fd, new_fd);
 
 		/* add to global client list */
-		if ((cl = uh_client_add(new_fd, serv)) != NULL)
+		if ((cl = uh_client_add(new_fd, serv, &peer)) != NULL)
 		{
-			/* add client socket to global fdset */
-			uloop_fd_add(&cl->fd, ULOOP_READ | ULOOP_WRITE);
+			cl->fd.cb = uh_client_cb;
 
 #ifdef HAVE_TLS
-			/* setup client tls context */
-			if (conf->tls)
+			/* setup client tls context, handshake is driven by the
+			 * client callback */
+			if (serv->tls)
 			{
-				if (conf->tls_accept(cl) < 1)
-				{
-					D("SRV: Client(%d) SSL handshake failed, drop\n", new_fd);
+				cl->handshaking = true;
+				clock_gettime(CLOCK_MONOTONIC, &cl->handshake_start);
 
-					/* remove from global client list */
-					uh_client_remove(cl);
-					return;
-				}
+				cl->timeout.cb = uh_handshake_timeout_cb;
+				uloop_timeout_set(&cl->timeout, conf->network_timeout * 1000);
+
+				uh_client_handshake(cl);
+				continue;
 			}
 #endif
 
-			cl->fd.cb = uh_client_cb;
-			fd_cloexec(new_fd);
+			/* add client socket to global fdset */
+			uh_client_poll(cl, ULOOP_READ | ULOOP_WRITE);
 		}
 
 		/* insufficient resources */
@@ -628,10 +1160,19 @@ static void uh_client_cb(struct uloop_fd *u, unsigned int events)
 	struct http_request *req;
 
 	cl = container_of(u, struct client, fd);
-	conf = cl->server->conf;
+	conf = cl->conf;
 
 	D("SRV: Client(%d) enter callback\n", u->fd);
 
+#ifdef HAVE_TLS
+	/* tls handshake in progress */
+	if (cl->handshaking)
+	{
+		uh_client_handshake(cl);
+		return;
+	}
+#endif
+
 	/* undispatched yet */
 	if (!cl->dispatched)
 	{
@@ -650,6 +1191,8 @@ static void uh_client_cb(struct uloop_fd *u, unsigned int events)
 			return;
 		}
 
+		uh_stats_mark(cl, UH_STATS_HEADERS);
+
 		/* process expect headers */
 		foreach_header(i, req->headers)
 		{
@@ -670,6 +1213,7 @@ static void uh_client_cb(struct uloop_fd *u, unsigned int events)
 				D("SRV: Client(%d) sending HTTP/1.1 100 Continue\n", u->fd);
 
 				uh_http_sendf(cl, NULL, "HTTP/1.1 100 Continue\r\n\r\n");
+				uh_tcp_flush(cl);
 				cl->httpbuf.len = 0; /* client will re-send the body */
 				break;
 			}
@@ -677,7 +1221,7 @@ static void uh_client_cb(struct uloop_fd *u, unsigned int events)
 
 		/* RFC1918 filtering */
 		if (conf->rfc1918_filter &&
-			sa_rfc1918(&cl->peeraddr) && !sa_rfc1918(&cl->servaddr))
+			sa_rfc1918(&cl->peeraddr) && !sa_rfc1918(uh_client_servaddr(cl)))
 		{
 			uh_http_sendhf(cl, 403, "Forbidden",
 						   "Rejected request from RFC1918 IP "
@@ -710,6 +1254,12 @@ static void uh_client_cb(struct uloop_fd *u, unsigned int events)
 		/* header processing complete */
 		D("SRV: Client(%d) dispatched\n", u->fd);
 		cl->dispatched = true;
+
+		/* response handlers pump their child from socket wakeups and
+		 * need level-triggered events, keep the interest they set */
+		if (cl->fd.registered && (cl->fd.flags & ULOOP_EDGE_TRIGGER))
+			uloop_fd_add(&cl->fd, cl->fd.flags & ~ULOOP_EDGE_TRIGGER);
+
 		return;
 	}
 
@@ -747,11 +1297,15 @@ static inline int uh_inittls(struct config *conf)
 		if (!(conf->tls_init   = dlsym(lib, "uh_tls_ctx_init"))      ||
 		    !(conf->tls_cert   = dlsym(lib, "uh_tls_ctx_cert"))      ||
 		    !(conf->tls_key    = dlsym(lib, "uh_tls_ctx_key"))       ||
+		    !(conf->tls_cache  = dlsym(lib, "uh_tls_ctx_cache"))     ||
+		    !(conf->tls_sni    = dlsym(lib, "uh_tls_ctx_sni"))       ||
 		    !(conf->tls_free   = dlsym(lib, "uh_tls_ctx_free"))      ||
 		    !(conf->tls_accept = dlsym(lib, "uh_tls_client_accept")) ||
 		    !(conf->tls_close  = dlsym(lib, "uh_tls_client_close"))  ||
 		    !(conf->tls_recv   = dlsym(lib, "uh_tls_client_recv"))   ||
-		    !(conf->tls_send   = dlsym(lib, "uh_tls_client_send")))
+		    !(conf->tls_send   = dlsym(lib, "uh_tls_client_send"))   ||
+		    !(conf->tls_flush  = dlsym(lib, "uh_tls_client_flush"))  ||
+		    !(conf->tls_sendfile = dlsym(lib, "uh_tls_client_sendfile")))
 		{
 			fprintf(stderr,
 					"Error: Failed to lookup required symbols "
@@ -782,6 +1336,11 @@ int main (int argc, char **argv)
 	struct sigaction sa;
 	struct config conf;
 
+	static struct uh_conn_stats conn_stats;
+#ifdef HAVE_TLS
+	static struct uh_tls_stats tls_stats;
+#endif
+
 	/* maximum file descriptor number */
 	int cur_fd, max_fd = 0;
 
@@ -816,6 +1375,28 @@ int main (int argc, char **argv)
 	sigaction(SIGINT,  &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
 
+	sa.sa_handler = uh_sighup;
+	sigaction(SIGHUP,  &sa, NULL);
+
+	sa.sa_handler = uh_sigusr2;
+	sigaction(SIGUSR2, &sa, NULL);
+
+	sa.sa_handler = uh_sigusr1;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	/* remember how we were started for upgrades, symlinks are kept so
+	 * that a replaced link target is picked up */
+	uh_argv = argv;
+
+	if ((argv[0][0] == '/') || !strchr(argv[0], '/') ||
+		!getcwd(uh_exe, sizeof(uh_exe) - strlen(argv[0]) - 1))
+		snprintf(uh_exe, sizeof(uh_exe), "%s", argv[0]);
+	else
+		strcat(strcat(uh_exe, "/"), argv[0]);
+
+	/* sockets handed over by a previous instance or a service manager */
+	uh_socket_inherit();
+
 	/* prepare addrinfo hints */
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family   = AF_UNSPEC;
@@ -826,10 +1407,17 @@ int main (int argc, char **argv)
 	memset(&conf, 0, sizeof(conf));
 	memset(bind, 0, sizeof(bind));
 
+	conf.conn_stats = &conn_stats;
+
+#ifdef HAVE_TLS
+	conf.tls_sessions = -1;
+	conf.tls_stats = &tls_stats;
+#endif
+
 	uloop_init();
 
 	while ((opt = getopt(argc, argv,
-						 "fSDRC:K:E:I:p:s:h:c:l:L:d:r:m:n:x:i:t:T:A:u:U:")) > 0)
+						 "fSDRBeX:a:C:K:N:Q:E:I:p:s:h:c:l:L:P:W:O:d:r:m:n:x:i:t:T:A:u:U:")) > 0)
 	{
 		switch(opt)
 		{
@@ -908,6 +1496,28 @@ int main (int argc, char **argv)
 				}
 
 				break;
+
+			/* per-hostname certificates */
+			case 'N':
+				if (!uh_inittls(&conf))
+				{
+					if (conf.tls_sni(conf.tls, optarg) < 1)
+					{
+						fprintf(stderr,
+								"Error: No usable certificates in %s\n",
+								optarg);
+						exit(1);
+					}
+				}
+
+				break;
+
+			/* session cache */
+			case 'Q':
+				conf.tls_sessions = 0;
+				sscanf(optarg, "%d:%d", &conf.tls_sessions,
+					   &conf.tls_session_lifetime);
+				break;
 #endif
 
 			/* docroot */
@@ -960,6 +1570,31 @@ int main (int argc, char **argv)
 				conf.max_requests = atoi(optarg);
 				break;
 
+			/* shed excess connections */
+			case 'B':
+				conf.shed_overload = 1;
+				break;
+
+			/* edge-triggered client sockets */
+			case 'e':
+				conf.edge_trigger = 1;
+				break;
+
+			/* status page */
+			case 'X':
+				conf.stats_url = optarg;
+				break;
+
+			/* access log */
+			case 'a':
+				if (!(conf.log = uh_log_init(optarg)))
+				{
+					fprintf(stderr, "Error: Unable to open access log %s: %s\n",
+							optarg, strerror(errno));
+					exit(1);
+				}
+				break;
+
 #ifdef HAVE_CGI
 			/* cgi prefix */
 			case 'x':
@@ -971,7 +1606,7 @@ int main (int argc, char **argv)
 				if ((optarg[0] == '.') && (port = strchr(optarg, '=')))
 				{
 					*port++ = 0;
-					uh_interpreter_add(optarg, port);
+					uh_interpreter_add(&conf, optarg, port);
 				}
 				else
 				{
@@ -992,6 +1627,23 @@ int main (int argc, char **argv)
 			case 'L':
 				conf.lua_handler = optarg;
 				break;
+
+			/* lua worker pool */
+			case 'W':
+				sscanf(optarg, "%d:%d:%d", &conf.lua_workers,
+					   &conf.lua_worker_requests, &conf.lua_worker_memory);
+				break;
+
+			/* lua modules to preload */
+			case 'P':
+				conf.lua_preload = optarg;
+				break;
+
+			/* in-process lua handler */
+			case 'O':
+				conf.lua_inproc = 1;
+				conf.lua_memory = atoi(optarg);
+				break;
 #endif
 
 #ifdef HAVE_UBUS
@@ -1073,6 +1725,12 @@ int main (int argc, char **argv)
 					"	-s [addr:]port  Like -p but provide HTTPS on this port\n"
 					"	-C file         ASN.1 server certificate file\n"
 					"	-K file         ASN.1 server private key file\n"
+					"	                -C and -K may be repeated to add an ECDSA\n"
+					"	                certificate next to the RSA one\n"
+					"	-N directory    Select certificates by SNI from host.crt and\n"
+					"	                host.key pairs, host@tag.crt adds more per host\n"
+					"	-Q n[:sec]      TLS session cache size and session lifetime,\n"
+					"	                0 disables session resumption\n"
 #endif
 					"	-h directory    Specify the document root, default is '.'\n"
 					"	-E string       Use given virtual URL as 404 error handler\n"
@@ -1081,9 +1739,23 @@ int main (int argc, char **argv)
 					"	-D              Do not allow directory listings, send 403 instead\n"
 					"	-R              Enable RFC1918 filter\n"
 					"	-n count        Maximum allowed number of concurrent requests\n"
+					"	-B              Answer requests beyond -n with 503 instead of\n"
+					"	                deferring them\n"
+					"	-e              Poll client sockets edge-triggered until the\n"
+					"	                request is dispatched\n"
+					"	-X url          Serve request statistics at url, append\n"
+					"	                ?format=prometheus for Prometheus, subject to\n"
+					"	                the auth realms of the configuration file\n"
+					"	-a file[:fmt]   Write an access log, fmt is common (default),\n"
+					"	                combined or json, SIGUSR1 reopens the file\n"
 #ifdef HAVE_LUA
 					"	-l string       URL prefix for Lua handler, default is '/lua'\n"
 					"	-L file         Lua handler script, omit to disable Lua\n"
+					"	-W n[:req[:kb]] Serve Lua from n pre-forked workers, recycled after\n"
+					"	                req requests or kb KB of Lua heap growth\n"
+					"	-O kbytes       Run Lua handler in-process as coroutines, limit Lua\n"
+					"	                heap to kbytes (0 = unlimited)\n"
+					"	-P mod[,mod]    Preload Lua modules before forking handlers\n"
 #endif
 #ifdef HAVE_UBUS
 					"	-u string       URL prefix for HTTP/JSON handler, default is '/ubus'\n"
@@ -1113,8 +1785,26 @@ int main (int argc, char **argv)
 		fprintf(stderr, "Error: Missing private key or certificate file\n");
 		exit(1);
 	}
+
+	if (conf.tls)
+	{
+		if (conf.tls_sessions < 0)
+			conf.tls_sessions = UH_TLS_SESSION_CACHE;
+
+		if (conf.tls_session_lifetime <= 0)
+			conf.tls_session_lifetime = UH_TLS_SESSION_LIFETIME;
+
+		if (conf.tls_cache(conf.tls, conf.tls_sessions,
+						   conf.tls_session_lifetime) < 1)
+		{
+			fprintf(stderr,
+					"Notice: Unable to set up TLS session resumption\n");
+		}
+	}
 #endif
 
+	bound += uh_socket_adopt(&serv_fds, &max_fd, &conf);
+
 	if (bound < 1)
 	{
 		fprintf(stderr, "Error: No sockets bound, unable to continue\n");
@@ -1133,9 +1823,6 @@ int main (int argc, char **argv)
 	if (!conf.realm)
 		conf.realm = "Protected Area";
 
-	/* config file */
-	uh_config_parse(&conf);
-
 	/* default max requests */
 	if (conf.max_requests <= 0)
 		conf.max_requests = 3;
@@ -1144,6 +1831,13 @@ int main (int argc, char **argv)
 	if (conf.network_timeout <= 0)
 		conf.network_timeout = 30;
 
+	/* request statistics, shared by all config generations */
+	if (conf.stats_url && !(conf.stats = uh_stats_init()))
+	{
+		fprintf(stderr, "Error: Unable to allocate request statistics\n");
+		exit(1);
+	}
+
 #if defined(HAVE_CGI) || defined(HAVE_LUA) || defined(HAVE_UBUS)
 	/* default script timeout */
 	if (conf.script_timeout <= 0)
@@ -1185,6 +1879,13 @@ int main (int argc, char **argv)
 			if (!conf.lua_prefix)
 				conf.lua_prefix = "/lua";
 
+			/* default worker recycling limits */
+			if (conf.lua_worker_requests <= 0)
+				conf.lua_worker_requests = UH_LUA_WORKER_REQUESTS;
+
+			if (conf.lua_worker_memory <= 0)
+				conf.lua_worker_memory = UH_LUA_WORKER_MEMORY;
+
 			conf.lua_state = conf.lua_init(&conf);
 		}
 	}
@@ -1221,6 +1922,16 @@ void *lib;
 //	}
 #endif
 
+	/* first config generation, SIGHUP swaps in a new one */
+	if (!(uh_conf = uh_config_load(&conf)))
+	{
+		fprintf(stderr, "Error: Unable to load configuration: %s\n",
+				strerror(errno));
+		exit(1);
+	}
+
+	uh_listener_update(uh_conf);
+
 	/* fork (if not disabled) */
 	if (!nofork)
 	{
@@ -1251,8 +1962,62 @@ void *lib;
 		}
 	}
 
+	/* access log writer, started late so it does not inherit the
+	 * controlling terminal */
+	if (conf.log && (uh_log_start(conf.log) < 0))
+	{
+		perror("Error: Unable to start access log writer");
+		exit(1);
+	}
+
 	/* server main loop */
-	uloop_run();
+	while (run)
+	{
+		uloop_run();
+
+		if (reload)
+		{
+			reload = 0;
+			uh_config_reload(&conf);
+		}
+
+		if (upgrade)
+		{
+			upgrade = 0;
+			uh_upgrade();
+		}
+	}
+
+	uh_config_put(uh_conf);
+
+	if (conf.log)
+	{
+		uh_log_close(conf.log);
+
+		if (conf.log->dropped)
+			fprintf(stderr, "Log: %lu records written, %lu dropped\n",
+					conf.log->records, conf.log->dropped);
+	}
+
+	if (conn_stats.deferred || conn_stats.shed)
+	{
+		fprintf(stderr, "Overload: %lu times deferred, %lu connections shed\n",
+				conn_stats.deferred, conn_stats.shed);
+	}
+
+#ifdef HAVE_TLS
+	if (tls_stats.handshakes || tls_stats.failures || tls_stats.timeouts)
+	{
+		fprintf(stderr,
+				"TLS: %lu handshakes, %lu resumed, %lu failed, %lu timed out, "
+				"latency avg %lluus max %luus\n",
+				tls_stats.handshakes, tls_stats.resumed,
+				tls_stats.failures, tls_stats.timeouts,
+				tls_stats.handshakes ?
+					tls_stats.latency_us / tls_stats.handshakes : 0,
+				tls_stats.latency_max_us);
+	}
+#endif
 
 #ifdef HAVE_LUA
 	/* destroy the Lua state */
@@ -24,6 +24,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
@@ -66,6 +67,16 @@
 
 #define UH_LIMIT_CLIENTS	64
 
+/* connections accepted per listener wakeup */
+#define UH_LIMIT_ACCEPT		16
+
+/* sockets taken over through LISTEN_FDS */
+#define UH_LIMIT_LISTENERS	32
+
+/* largest single sendfile() transfer, the Linux maximum also fits
+ * SSIZE_MAX on 32 bit */
+#define UH_LIMIT_SENDFILE	0x7ffff000
+
 #define UH_HTTP_MSG_GET		0
 #define UH_HTTP_MSG_HEAD	1
 #define UH_HTTP_MSG_POST	2
@@ -73,13 +84,61 @@
 #define UH_SOCK_CLIENT		0
 #define UH_SOCK_SERVER		1
 
+#ifdef HAVE_TLS
+struct uh_tls_stats {
+	unsigned long handshakes;
+	unsigned long resumed;
+	unsigned long failures;
+	unsigned long timeouts;
+	unsigned long long latency_us;
+	unsigned long latency_max_us;
+};
+#endif
+
+/* connections turned away at max_requests */
+struct uh_conn_stats {
+	unsigned long deferred;
+	unsigned long shed;
+};
+
+/* request phases timestamped when -X is given */
+#define UH_STATS_ACCEPT		0
+#define UH_STATS_HEADERS	1
+#define UH_STATS_DISPATCH	2
+#define UH_STATS_FIRST_BYTE	3
+#define UH_STATS_DONE		4
+#define UH_STATS_PHASES		5
+
+/* handlers latencies are broken down by */
+#define UH_STATS_OTHER		0
+#define UH_STATS_FILE		1
+#define UH_STATS_CGI		2
+#define UH_STATS_LUA		3
+#define UH_STATS_UBUS		4
+#define UH_STATS_HANDLERS	5
+
+struct uh_request_stats {
+	unsigned long long ts[UH_STATS_PHASES];
+	unsigned long long bytes;
+	int handler;
+	int status;
+};
+
+struct uh_stats;
+struct uh_log;
 struct listener;
 struct client;
 struct interpreter;
 struct http_request;
 struct uh_ubus_state;
+struct auth_realm;
+struct auth_trie_node;
+struct auth_trie_user;
 
+/* command line options are kept in a base config, each reload derives a
+ * new refcounted generation from it; clients pin the one they started on */
 struct config {
+	int refcount;
 	char docroot[PATH_MAX];
 	char *realm;
 	char *file;
@@ -91,12 +150,28 @@ struct config {
 	int rfc1918_filter;
 	int tcp_keepalive;
 	int max_requests;
+	int shed_overload;
+	int edge_trigger;
+	char *stats_url;
+	struct uh_stats *stats;
+	struct uh_log *log;
+	struct uh_conn_stats *conn_stats;
+	struct auth_realm *realms;
+	struct auth_trie_node *realm_trie;
+	struct auth_trie_user *realm_users;
 #ifdef HAVE_CGI
 	char *cgi_prefix;
+	struct interpreter *interpreters;
 #endif
 #ifdef HAVE_LUA
 	char *lua_prefix;
 	char *lua_handler;
+	char *lua_preload;
+	int lua_workers;
+	int lua_worker_requests;
+	int lua_worker_memory;
+	int lua_inproc;
+	int lua_memory;
 	lua_State *lua_state;
 	lua_State * (*lua_init) (const struct config *conf);
 	void (*lua_close) (lua_State *L);
@@ -116,15 +191,22 @@ struct config {
 #ifdef HAVE_TLS
 	char *cert;
 	char *key;
+	int tls_sessions;
+	int tls_session_lifetime;
 	SSL_CTX *tls;
 	SSL_CTX * (*tls_init) (void);
 	int (*tls_cert) (SSL_CTX *c, const char *file);
 	int (*tls_key) (SSL_CTX *c, const char *file);
+	int (*tls_cache) (SSL_CTX *c, int size, int lifetime);
+	int (*tls_sni) (SSL_CTX *c, const char *dir);
 	void (*tls_free) (struct listener *l);
 	int (*tls_accept) (struct client *c);
 	void (*tls_close) (struct client *c);
 	int (*tls_recv) (struct client *c, char *buf, int len);
 	int (*tls_send) (struct client *c, const char *buf, int len);
+	int (*tls_flush) (struct client *c);
+	ssize_t (*tls_sendfile) (struct client *c, int fd, off_t offset, off_t len);
+	struct uh_tls_stats *tls_stats;
 #endif
 };
 
@@ -147,6 +229,7 @@ struct listener {
 	struct uloop_fd fd;
 	int socket;
 	int n_clients;
+	bool paused;
 	struct sockaddr_in6 addr;
 	struct config *conf;
 #ifdef HAVE_TLS
@@ -166,14 +249,20 @@ struct client {
 	void *priv;
 	bool dispatched;
 	bool dead;
+#ifdef HAVE_TLS
+	bool handshaking;
+	struct timespec handshake_start;
+#endif
 	struct {
 		char buf[UH_LIMIT_MSGHEAD];
 		char *ptr;
 		int len;
 	} httpbuf;
 	struct listener *server;
+	struct config *conf;
 	struct http_request request;
 	struct http_response response;
+	struct uh_request_stats stats;
 	struct sockaddr_in6 servaddr;
 	struct sockaddr_in6 peeraddr;
 	struct client *next;